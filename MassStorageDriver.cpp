@@ -39,11 +39,20 @@
 				  ((x >> 8) & 0xff00) |  \
                   ((x << 24) & 0xff000000)
 
+// Mass Storage, SCSI transparent command set, Bulk-Only Transport
+static const driver_match_t msc_match[] = {
+	{driver_match_t::INTERFACE, driver_match_t::CLASS | driver_match_t::SUBCLASS
+		| driver_match_t::PROTOCOL, 0, 0, 8, 6, 80}
+};
+
 void msController::init()
 {
-	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	contribute_Pipes(mypipes, myqhs, sizeof(mypipes)/sizeof(Pipe_t));
+	contribute_Transfers(mytransfers, myqtds, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+#endif
+	match_table(msc_match, sizeof(msc_match)/sizeof(driver_match_t));
 	driver_ready_for_device(this);
 }
 
@@ -153,8 +162,8 @@ void msController::callbackIn(const Transfer_t *transfer)
 {
 	println("msController CallbackIn (static)");
 	if (transfer->driver) {
-		print("transfer->qtd.token = ");
-		println(transfer->qtd.token & 255);
+		print("transfer->qtd->token = ");
+		println(transfer->qtd->token & 255);
 		((msController *)(transfer->driver))->new_dataIn(transfer);
 	}
 }
@@ -163,15 +172,15 @@ void msController::callbackOut(const Transfer_t *transfer)
 {
 	println("msController CallbackOut (static)");
 	if (transfer->driver) {
-		print("transfer->qtd.token = ");
-		println(transfer->qtd.token & 255);
+		print("transfer->qtd->token = ");
+		println(transfer->qtd->token & 255);
 		((msController *)(transfer->driver))->new_dataOut(transfer);
 	}
 }
 
 void msController::new_dataOut(const Transfer_t *transfer)
 {
-	uint32_t len = transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF);
+	uint32_t len = transfer->length - ((transfer->qtd->token >> 16) & 0x7FFF);
 	println("msController dataOut (static)", len, DEC);
 	print_hexbytes((uint8_t*)transfer->buffer, (len < 32)? len : 32 );
 	msOutCompleted = true; // Last out transaction is completed.
@@ -179,7 +188,7 @@ void msController::new_dataOut(const Transfer_t *transfer)
 
 void msController::new_dataIn(const Transfer_t *transfer)
 {
-	uint32_t len = transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF);
+	uint32_t len = transfer->length - ((transfer->qtd->token >> 16) & 0x7FFF);
 	println("msController dataIn (static): ", len, DEC);
 	print_hexbytes((uint8_t*)transfer->buffer, (len < 32)? len : 32 );
 	if (_read_sectors_callback) {
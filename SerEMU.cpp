@@ -29,7 +29,9 @@
 
 void USBSerialEmu::init()
 {
-	USBHost::contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	USBHost::contribute_Transfers(mytransfers, myqtds, sizeof(mytransfers)/sizeof(Transfer_t));
+#endif
 	USBHIDParser::driver_ready_for_hid_collection(this);	
 }
 
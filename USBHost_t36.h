@@ -62,6 +62,30 @@
 //#define USBHOST_PRINT_DEBUG
 
 
+// Uncomment this line to remove the Device_t, Pipe_t, Transfer_t and
+// string buffers built into every driver object.  Your program must then
+// create one USBHostMemory<> object (see below) which supplies all of them.
+//#define USBHOST_NO_DRIVER_MEMORY
+
+
+// Uncomment this line to record when each step of connecting and
+// enumerating happens, for every device.  Use enumerationTiming()
+// on any driver to learn where a device's startup time goes.
+//#define USBHOST_ENUM_TIMING
+
+
+// Number of 64 byte IN report buffers each HID parser rotates.  All but
+// one stay queued to the device while a report is parsed, so fast (1 to
+// 8 kHz) mice and game controllers always have somewhere to send the
+// next report.  Raise this if reportOverruns() is not zero.
+#ifndef USBHOST_HID_REPORT_BUFFERS
+#define USBHOST_HID_REPORT_BUFFERS 4
+#endif
+#if USBHOST_HID_REPORT_BUFFERS < 2
+#error "USBHOST_HID_REPORT_BUFFERS must be at least 2"
+#endif
+
+
 // This can let you control where to send the debugging messages
 //#define USBHDBGSerial	Serial1
 #ifndef USBHDBGSerial
@@ -91,6 +115,16 @@ class USBHost;
 typedef struct Device_struct       Device_t;
 typedef struct Pipe_struct         Pipe_t;
 typedef struct Transfer_struct     Transfer_t;
+
+// These 2 structures are the hardware descriptors the EHCI
+// accesses by DMA.  Each Pipe_t owns one QH_t and each
+// Transfer_t owns one qTD_t.  They are allocated in pairs,
+// from parallel arrays, so only the hardware portion needs
+// 32 byte alignment and DMA access.
+typedef struct QH_struct           QH_t;
+typedef struct qTD_struct          qTD_t;
+typedef struct descriptor_cache_struct descriptor_cache_t;
+typedef struct enum_buffer_struct  enum_buffer_t;
 typedef enum { CLAIM_NO=0, CLAIM_REPORT, CLAIM_INTERFACE} hidclaim_t;
 
 // All USB device drivers inherit use these classes.
@@ -177,6 +211,40 @@ typedef struct {
 	uint8_t buffer[STRING_BUF_SIZE];
 } strbuf_t;
 
+// Drivers may list the devices, interfaces and IADs they are able to
+// claim.  Only drivers whose list matches are offered a chance to claim,
+// so claim() is not called for every driver on every interface.
+typedef struct {
+	enum {DEVICE=1, INTERFACE=2, IAD=4};   // types, claim() type 0, 1, 2
+	enum {VENDOR=1, PRODUCT=2, CLASS=4, SUBCLASS=8, PROTOCOL=16}; // match
+	uint8_t  types;
+	uint8_t  match;
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint8_t  bClass;     // device, interface or IAD function class
+	uint8_t  bSubClass;
+	uint8_t  bProtocol;
+} driver_match_t;
+
+// Times, from micros(), when each step of a device's connection and
+// enumeration was completed.  Zero means the step has not happened.
+// A gap between DEBOUNCE and RESET is time spent waiting while other
+// ports reset or other devices enumerate.
+typedef struct {
+	enum {CONNECT=0,    // port connection detected
+		DEBOUNCE,   // port connection stable for 100 ms
+		RESET,      // port reset started
+		RECOVERY,   // port reset finished, now enabled
+		ENUMERATE,  // reset recovery finished, Device_t created
+		DEVICE_DESC, // device descriptor read, address assigned
+		STRINGS,    // string descriptors read (or skipped)
+		CONFIG_DESC, // configuration descriptor read
+		SET_CONFIG, // SET_CONFIGURATION completed
+		CLAIMED,    // drivers claimed, device ready to use
+		STAGE_CNT};
+	uint32_t usec[STAGE_CNT];
+} enum_timing_t;
+
 #define DEVICE_STRUCT_STRING_BUF_SIZE 50
 
 // Device_t holds all the information about a USB device
@@ -196,30 +264,132 @@ struct Device_struct {
 	uint8_t  bDeviceProtocol;
 	uint8_t  bmAttributes;
 	uint8_t  bMaxPower;
+	uint8_t  bNumConfigurations;
+	uint8_t  bConfigurationValue; // configuration in use
+	uint8_t  config_index;        // its descriptor index
 	uint16_t idVendor;
 	uint16_t idProduct;
+	uint16_t bcdDevice;
 	uint16_t LanguageID;
+	uint8_t  string_index[3]; // iManufacturer, iProduct, iSerialNumber
+	uint8_t  strings_pending; // 0=none, 1=not read yet, 2=read requested
+	enum_buffer_t *enumbuf;   // only while enumerating
+#ifdef USBHOST_ENUM_TIMING
+	enum_timing_t timing;
+#endif
+};
+
+// Devices attaching (configured and claimed by drivers) and detaching
+// are reported with these events.
+typedef struct {
+	enum {ATTACH=1, DETACH};
+	uint8_t  type;
+	uint8_t  speed;      // 0=12, 1=1.5, 2=480 Mbit/sec
+	uint8_t  address;
+	uint8_t  lost;       // events dropped before this one, queue was full
+	uint8_t  depth;      // number of hubs between the host and the device
+	uint8_t  path[6];    // hub port numbers, from the host downward
+	uint8_t  bDeviceClass;
+	uint8_t  bDeviceSubClass;
+	uint8_t  bDeviceProtocol;
+	uint16_t idVendor;
+	uint16_t idProduct;
+	USBDriver *driver;   // a driver bound to the device, or NULL
+} hotplug_event_t;
+
+// One device in the list from USBHost::getTopology()
+typedef struct {
+	uint8_t  address;
+	uint8_t  hub_address; // 0 = connected to the host port
+	uint8_t  hub_port;
+	uint8_t  depth;       // number of hubs between the host and the device
+	uint8_t  speed;       // 0=12, 1=1.5, 2=480 Mbit/sec
+	uint8_t  configured;  // 0 while enumerating, or if not enough power
+	uint8_t  self_powered;
+	uint8_t  bDeviceClass; // 9 = hub
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t power_mA;    // current the device declares, bMaxPower
+	uint16_t upstream_mA; // current from its port, including bus powered hub ports
+} device_topology_t;
+
+// Descriptors saved from an earlier connection, so a device which
+// reconnects can be configured without reading them again.
+struct descriptor_cache_struct {
+	descriptor_cache_t *next; // least recently used is last
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	uint16_t LanguageID;
+	uint8_t  bDeviceClass;
+	uint8_t  bDeviceSubClass;
+	uint8_t  bDeviceProtocol;
+	uint8_t  has_strings;
+	uint16_t config_len; // wTotalLength, 0 = unused entry
+	uint16_t config_max;
+	uint8_t  *config;
+	strbuf_t strings;
+};
+
+// Descriptors and state of a device being enumerated.  Only address
+// zero is shared, so once a device has its address, it continues
+// enumerating with its own enum_buffer_t while the next port resets.
+struct enum_buffer_struct {
+	uint8_t  buf[512] __attribute__ ((aligned(16)));
+	setup_t  setup __attribute__ ((aligned(16)));
+	enum_buffer_t *next;
+	descriptor_cache_t *cache; // cached descriptors being tried
+	uint32_t preference; // of the most preferred configuration so far
+	uint8_t  config;     // next configuration to read, if several
+	// Configuration descriptors larger than buf are read in windows.
+	// buf holds len bytes starting at offset, of the complete total
+	// bytes.  claim_drivers resumes parsing at parse, and skips the
+	// interface numbers set in claimed.
+	uint16_t len;
+	uint16_t total;
+	uint16_t offset;
+	uint16_t parse;
+	uint32_t claimed[8]; // bitmap of interfaces claimed, or too large
+};
+
+// Queue Head (QH), EHCI page 46-50.  The EHCI uses only the first
+// 48 bytes.  Because each QH must be aligned to a 32 byte boundary,
+// the remaining 16 bytes are free for a pointer back to the Pipe_t,
+// which lets the schedule be walked from the hardware links.
+struct QH_struct {  // must be aligned to 32 byte boundary
+	volatile uint32_t horizontal_link;
+	volatile uint32_t capabilities[2];
+	volatile uint32_t current;
+	volatile uint32_t next;
+	volatile uint32_t alt_next;
+	volatile uint32_t token;
+	volatile uint32_t buffer[5];
+	Pipe_t   *pipe; // not used by EHCI
+	uint32_t unused1;
+	uint32_t unused2;
+	uint32_t unused3;
+};
+
+// Queue Element Transfer Descriptor (qTD), EHCI pg 40-45
+struct qTD_struct {  // must be aligned to 32 byte boundary
+	volatile uint32_t next;
+	volatile uint32_t alt_next;
+	volatile uint32_t token;
+	volatile uint32_t buffer[5];
 };
 
 // Pipe_t holes all information about each USB endpoint/pipe
-// The first half is an EHCI QH structure for the pipe.
+// The EHCI QH structure for the pipe is kept separately, in
+// DMA memory contributed along with the Pipe_t.
 struct Pipe_struct {
-	// Queue Head (QH), EHCI page 46-50
-	struct {  // must be aligned to 32 byte boundary
-		volatile uint32_t horizontal_link;
-		volatile uint32_t capabilities[2];
-		volatile uint32_t current;
-		volatile uint32_t next;
-		volatile uint32_t alt_next;
-		volatile uint32_t token;
-		volatile uint32_t buffer[5];
-	} qh;
+	QH_t     *qh;
 	Device_t *device;
 	uint8_t  type; // 0=control, 1=isochronous, 2=bulk, 3=interrupt
 	uint8_t  direction; // 0=out, 1=in (changes for control, others fixed)
 	uint8_t  start_mask;
 	uint8_t  complete_mask;
 	Pipe_t   *next;
+	Transfer_t *halt; // inactive qTD at the end of the QH's list
 	void     (*callback_function)(const Transfer_t *);
 	uint16_t periodic_interval;
 	uint16_t periodic_offset;
@@ -228,29 +398,26 @@ struct Pipe_struct {
 	uint16_t bandwidth_shift;
 	uint8_t  bandwidth_stime;
 	uint8_t  bandwidth_ctime;
-	uint32_t unused1;
-	uint32_t unused2;
-	uint32_t unused3;
-	uint32_t unused4;
-	uint32_t unused5;
 };
 
+// When a transfer completed: the EHCI frame index (frame number in
+// bits 13:3, microframe in bits 2:0, 14 bits total) and the ARM cycle
+// counter, both read when the completion interrupt is processed.
+typedef struct {
+	uint32_t frindex;
+	uint32_t cycles;
+} usb_timestamp_t;
+
 // Transfer_t represents a single transaction on the USB bus.
-// The first portion is an EHCI qTD structure.  Transfer_t are
+// Each Transfer_t has its own EHCI qTD structure.  Transfer_t are
 // allocated as-needed from a memory pool, loaded with pointers
 // to the actual data buffers, linked into a followup list,
-// and placed on ECHI Queue Heads.  When the ECHI interrupt
-// occurs, the followup lists are used to find the Transfer_t
-// in memory.  Callbacks are made, and then the Transfer_t are
-// returned to the memory pool.
+// and their qTDs placed on ECHI Queue Heads.  When the ECHI
+// interrupt occurs, the followup lists are used to find the
+// Transfer_t in memory.  Callbacks are made, and then the
+// Transfer_t are returned to the memory pool.
 struct Transfer_struct {
-	// Queue Element Transfer Descriptor (qTD), EHCI pg 40-45
-	struct {  // must be aligned to 32 byte boundary
-		volatile uint32_t next;
-		volatile uint32_t alt_next;
-		volatile uint32_t token;
-		volatile uint32_t buffer[5];
-	} qtd;
+	qTD_t      *qtd;
 	// Linked list of queued, not-yet-completed transfers
 	Transfer_t *next_followup;
 	Transfer_t *prev_followup;
@@ -263,6 +430,7 @@ struct Transfer_struct {
 	uint32_t   length;
 	setup_t    setup;
 	USBDriver  *driver;
+	usb_timestamp_t timestamp;
 };
 
 
@@ -275,6 +443,29 @@ public:
 	static void begin();
 	static void Task();
 	static void countFree(uint32_t &devices, uint32_t &pipes, uint32_t &trans, uint32_t &strs);
+	// Choose when string descriptors are read.  By default they are read
+	// during enumeration, which delays every other device waiting to
+	// enumerate.  STRINGS_AFTER_CLAIM reads them after drivers claim the
+	// device.  STRINGS_ON_DEMAND reads them only when manufacturer(),
+	// product() or serialNumber() is first called.  Until the strings
+	// arrive, those functions return an empty string.
+	enum { STRINGS_DURING_ENUMERATION=0, STRINGS_AFTER_CLAIM, STRINGS_ON_DEMAND };
+	static void setStringMode(uint8_t mode) { string_mode = mode; }
+	static void request_strings(Device_t *dev);
+	static void descriptorCacheStats(uint32_t &hits, uint32_t &misses);
+	// Attach and detach events are kept in a small queue.  Programs
+	// may read them, or have Task() call a function for each event,
+	// rather than checking every driver object.
+	static bool getHotplugEvent(hotplug_event_t &event);
+	// List all connected devices, as a tree of hubs and their ports,
+	// with the current each takes.  Devices which would take more
+	// current than their port may supply are not configured.  By
+	// default the host port may supply 500 mA.
+	static uint32_t getTopology(device_topology_t *list, uint32_t max);
+	static void setPowerBudget(uint32_t mA) { power_budget = mA; }
+	static void attachHotplug(void (*f)(const hotplug_event_t &event)) {
+		hotplug_callback = f;
+	}
 protected:
 	static Pipe_t * new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint,
 		uint32_t direction, uint32_t maxlen, uint32_t interval=0);
@@ -282,22 +473,51 @@ protected:
 		void *buf, USBDriver *driver);
 	static bool queue_Data_Transfer(Pipe_t *pipe, void *buffer,
 		uint32_t len, USBDriver *driver);
+	static bool set_interface(Device_t *dev, const uint8_t *desc, uint32_t len,
+		Pipe_t **pipes, uint32_t num, setup_t *setup, USBDriver *driver);
 	static Device_t * new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_port);
 	static void disconnect_Device(Device_t *dev);
 	static void enumeration(const Transfer_t *transfer);
 	static void driver_ready_for_device(USBDriver *driver);
 	static volatile bool enumeration_busy;
+	static uint8_t string_mode;
+	static void (*hotplug_callback)(const hotplug_event_t &event);
+	static uint16_t power_budget;
+	// Record the first time a device reaches an enumeration stage
+	static void enum_timing(Device_t *dev, uint32_t stage) {
+#ifdef USBHOST_ENUM_TIMING
+		if (dev->timing.usec[stage] == 0) dev->timing.usec[stage] = micros();
+#endif
+	}
+#ifdef USBHOST_ENUM_TIMING
+	// Port stages, recorded by the port which is resetting, and
+	// copied to its Device_t by new_Device()
+	static enum_timing_t port_timing;
+#endif
 public: // Maybe others may want/need to contribute memory example HID devices may want to add transfers.
 	static void contribute_Devices(Device_t *devices, uint32_t num);
-	static void contribute_Pipes(Pipe_t *pipes, uint32_t num);
-	static void contribute_Transfers(Transfer_t *transfers, uint32_t num);
+	static void contribute_Pipes(Pipe_t *pipes, QH_t *qhs, uint32_t num);
+	static void contribute_Transfers(Transfer_t *transfers, qTD_t *qtds, uint32_t num);
 	static void contribute_String_Buffers(strbuf_t *strbuf, uint32_t num);
+	static void contribute_Descriptor_Cache(descriptor_cache_t *entries, uint32_t num);
+	static void contribute_Enumeration_Buffers(enum_buffer_t *bufs, uint32_t num);
 private:
 	static void isr();
 	static void convertStringDescriptorToASCIIString(uint8_t string_index, Device_t *dev, const Transfer_t *transfer);
-	static void claim_drivers(Device_t *dev);
+	static bool claim_drivers(Device_t *dev);
+	static uint32_t rate_configuration(Device_t *dev, const uint8_t *config, uint32_t len);
+	static bool driver_matches(const USBDriver *driver, const Device_t *dev,
+		int type, const uint8_t *p);
+	static bool offer_to_drivers(Device_t *dev, int type, const uint8_t *p, uint32_t len);
+	static void begin_strings(Device_t *dev);
+	static void hotplug(Device_t *dev, uint8_t type);
+	static bool power_available(const Device_t *dev);
 	static uint32_t assign_address(void);
+	static void enumeration_failed(Device_t *dev);
+	static void disable_root_port(void);
 	static bool queue_Transfer(Pipe_t *pipe, Transfer_t *transfer);
+	static bool queue_Control_Window(Device_t *dev, setup_t *setup,
+		void *buf, uint32_t offset, USBDriver *driver);
 	static void init_Device_Pipe_Transfer_memory(void);
 	static Device_t * allocate_Device(void);
 	static void delete_Pipe(Pipe_t *pipe);
@@ -396,6 +616,80 @@ protected:
 };
 
 
+/************************************************/
+/*  Memory Pool                                 */
+/************************************************/
+
+// USBHostMemory lets a program size the Device_t, Pipe_t, Transfer_t
+// and string buffer pools at compile time, with one object instead of
+// memory spread across every driver instance.  Create it as a static
+// object, like the drivers:
+//
+//   USBHostMemory<4, 12, 32, 4> usbmemory;  // devices, pipes, transfers, strings
+//
+// With USBHOST_NO_DRIVER_MEMORY defined, this is the only memory the
+// library has.  Otherwise it adds to what the drivers contribute.
+template <uint32_t DEVICES, uint32_t PIPES, uint32_t TRANSFERS, uint32_t STRINGS=1,
+	uint32_t ENUM_BUFFERS=1>
+class USBHostMemory {
+public:
+	// The EHCI requires QH and qTD structures on 32 byte boundaries.
+	static_assert((sizeof(QH_t) & 0x1F) == 0, "QH_t must be a multiple of 32 bytes");
+	static_assert((sizeof(qTD_t) & 0x1F) == 0, "qTD_t must be a multiple of 32 bytes");
+	// Enumerating a device takes 1 Device_t, its control pipe, the
+	// pipe's halt qTD and 3 qTDs for a control transfer.  Every device
+	// also needs 1 string buffer to hold its manufacturer, product and
+	// serial number strings.  Each enumeration buffer lets one more
+	// device enumerate at the same time (one is built in).
+	static_assert(DEVICES >= 1, "USBHostMemory needs at least 1 Device_t");
+	static_assert(PIPES >= DEVICES, "USBHostMemory needs a control Pipe_t for every Device_t");
+	static_assert(TRANSFERS >= PIPES + 3, "USBHostMemory needs at least 1 Transfer_t per Pipe_t, plus 3 for control");
+	USBHostMemory() {
+		USBHost::contribute_Devices(devices, DEVICES);
+		USBHost::contribute_Pipes(pipes, qhs, PIPES);
+		USBHost::contribute_Transfers(transfers, qtds, TRANSFERS);
+		USBHost::contribute_String_Buffers(strbufs, STRINGS);
+		USBHost::contribute_Enumeration_Buffers(enumbufs, ENUM_BUFFERS);
+	}
+private:
+	// EHCI DMA memory, kept together
+	QH_t qhs[PIPES] __attribute__ ((aligned(32)));
+	qTD_t qtds[TRANSFERS] __attribute__ ((aligned(32)));
+	// software bookkeeping, used only by the CPU
+	Pipe_t pipes[PIPES];
+	Transfer_t transfers[TRANSFERS];
+	Device_t devices[DEVICES];
+	strbuf_t strbufs[STRINGS];
+	enum_buffer_t enumbufs[ENUM_BUFFERS];
+};
+
+// USBHostDescriptorCache remembers the descriptors of recently
+// connected devices.  When the same device (vendor, product, version
+// and serial number) connects again, only its device descriptor and
+// the first 9 bytes of its configuration are read.  If these still
+// match, the strings and full configuration are used from the cache.
+//
+//   USBHostDescriptorCache<4> desccache;  // remember 4 devices
+//
+// Devices with a serial number are cached only when strings are read
+// during enumeration.  Configurations larger than CONFIG_SIZE are not
+// cached.
+template <uint32_t ENTRIES, uint32_t CONFIG_SIZE=512>
+class USBHostDescriptorCache {
+public:
+	USBHostDescriptorCache() {
+		for (uint32_t i=0; i < ENTRIES; i++) {
+			entries[i].config = config[i];
+			entries[i].config_max = CONFIG_SIZE;
+		}
+		USBHost::contribute_Descriptor_Cache(entries, ENTRIES);
+	}
+private:
+	descriptor_cache_t entries[ENTRIES];
+	uint8_t config[ENTRIES][CONFIG_SIZE];
+};
+
+
 /************************************************/
 /*  USB Device Driver Common Base Class         */
 /************************************************/
@@ -418,31 +712,72 @@ public:
 	const uint8_t *manufacturer() {
 		Device_t *dev = *(Device_t * volatile *)&device;
 		if (dev == nullptr || dev->strbuf == nullptr) return nullptr;
+		request_strings(dev);
 		return &dev->strbuf->buffer[dev->strbuf->iStrings[strbuf_t::STR_ID_MAN]];
 	}
 	const uint8_t *product() {
 		Device_t *dev = *(Device_t * volatile *)&device;
 		if (dev == nullptr || dev->strbuf == nullptr) return nullptr;
+		request_strings(dev);
 		return &dev->strbuf->buffer[dev->strbuf->iStrings[strbuf_t::STR_ID_PROD]];
 	}
 	const uint8_t *serialNumber() {
 		Device_t *dev = *(Device_t * volatile *)&device;
 		if (dev == nullptr || dev->strbuf == nullptr) return nullptr;
+		request_strings(dev);
 		return &dev->strbuf->buffer[dev->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]];
 	}
+	// With USBHOST_ENUM_TIMING defined, when each enumeration step
+	// of this driver's device happened.  Otherwise NULL.
+	const enum_timing_t *enumerationTiming() {
+#ifdef USBHOST_ENUM_TIMING
+		Device_t *dev = *(Device_t * volatile *)&device;
+		return (dev != nullptr) ? &dev->timing : nullptr;
+#else
+		return nullptr;
+#endif
+	}
 protected:
-	USBDriver() : next(NULL), device(NULL) {}
+	USBDriver() : next(NULL), device(NULL), match_list(NULL), match_count(0),
+		id_list(NULL), id_count(0), id_stride(0), id_types(0) {}
+	// Limit which devices and interfaces are offered to claim().  A
+	// driver may give a list of class matches, a list of vendor &
+	// product IDs, or both.  Anything matching either list is offered.
+	// Drivers which give neither are offered everything.
+	void match_table(const driver_match_t *list, uint8_t count) {
+		match_list = list;
+		match_count = count;
+	}
+	// The ID list may be any array of structs which begin with
+	// uint16_t idVendor, uint16_t idProduct, like pid_vid_mapping.
+	template <typename T, size_t N>
+	void match_ids(const T (&list)[N], uint8_t types) {
+		id_list = (const uint8_t *)list;
+		id_count = N;
+		id_stride = sizeof(T);
+		id_types = types;
+	}
 	// Check if a driver wishes to claim a device or interface or group
 	// of interfaces within a device.  When this function returns true,
 	// the driver is considered bound or loaded for that device.  When
 	// new devices are detected, enumeration.cpp calls this function on
-	// all unbound driver objects, to give them an opportunity to bind
-	// to the new device.
+	// all unbound driver objects whose match lists permit, to give them
+	// an opportunity to bind to the new device.
 	//   device has its vid&pid, class/subclass fields initialized
 	//   type is 0 for device level, 1 for interface level, 2 for IAD
 	//   descriptors points to the specific descriptor data
+	//   len for type 1 covers the interface, its alternate settings and
+	//     their endpoints.  For type 2 it covers the IAD and all its
+	//     interfaces.  For type 0, all of the configuration.
 	virtual bool claim(Device_t *device, int type, const uint8_t *descriptors, uint32_t len);
 
+	// When a device has more than one configuration, this function is
+	// called for each one before any are claimed, with its configuration
+	// descriptor (up to the first 512 bytes).  The configuration most
+	// preferred by all drivers is used, or the first if none has any
+	// preference.  This function is optional.
+	virtual uint32_t config_preference(Device_t *device, const uint8_t *config, uint32_t len) { return 0; }
+
 	// When an unknown (not chapter 9) control transfer completes, this
 	// function is called for all drivers bound to the device.  Return
 	// true means this driver originated this control transfer, so no
@@ -481,6 +816,14 @@ protected:
 	// wish to claim any device or interface (eg, if getting data
 	// from the HID parser).
 	Device_t *device;
+
+	// Match lists, checked by enumeration.cpp before calling claim()
+	const driver_match_t *match_list;
+	uint8_t match_count;
+	const uint8_t *id_list;
+	uint16_t id_count;
+	uint8_t id_stride;
+	uint8_t id_types;
 	friend class USBHost;
 };
 
@@ -515,12 +858,28 @@ public:
 	operator bool() { return (mydevice != nullptr); }
 	uint16_t idVendor() { return (mydevice != nullptr) ? mydevice->idVendor : 0; }
 	uint16_t idProduct() { return (mydevice != nullptr) ? mydevice->idProduct : 0; }
-	const uint8_t *manufacturer()
-		{  return  ((mydevice == nullptr) || (mydevice->strbuf == nullptr)) ? nullptr : &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_MAN]]; }
-	const uint8_t *product()
-		{  return  ((mydevice == nullptr) || (mydevice->strbuf == nullptr)) ? nullptr : &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_PROD]]; }
-	const uint8_t *serialNumber()
-		{  return  ((mydevice == nullptr) || (mydevice->strbuf == nullptr)) ? nullptr : &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]]; }
+	const uint8_t *manufacturer() {
+		if ((mydevice == nullptr) || (mydevice->strbuf == nullptr)) return nullptr;
+		USBHost::request_strings(mydevice);
+		return &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_MAN]];
+	}
+	const uint8_t *product() {
+		if ((mydevice == nullptr) || (mydevice->strbuf == nullptr)) return nullptr;
+		USBHost::request_strings(mydevice);
+		return &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_PROD]];
+	}
+	const uint8_t *serialNumber() {
+		if ((mydevice == nullptr) || (mydevice->strbuf == nullptr)) return nullptr;
+		USBHost::request_strings(mydevice);
+		return &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]];
+	}
+	// When the report holding the most recent input arrived.
+	const usb_timestamp_t & getTimestamp() { return input_timestamp; }
+	// Physical Minimum, Physical Maximum and Unit Exponent of the
+	// field being delivered, valid from hid_input_begin() on.
+	int32_t physicalMinimum() { return input_physical_min; }
+	int32_t physicalMaximum() { return input_physical_max; }
+	int8_t unitExponent() { return input_unit_exponent; }
 
 
 private:
@@ -533,11 +892,18 @@ private:
 	virtual void hid_input_end();
 	virtual void disconnect_collection(Device_t *dev);
 	virtual void hid_timer_event(USBDriverTimer *whichTimer) { }
+	// Return true to receive only absolute fields which changed since
+	// the previous report with the same Report ID.
+	virtual bool hid_changed_fields_only() { return false; }
 	void add_to_list();
 	USBHIDInput *next = NULL;
 	friend class USBHIDParser;
 protected:
 	Device_t *mydevice = NULL;
+	usb_timestamp_t input_timestamp = {0, 0};
+	int32_t input_physical_min = 0;
+	int32_t input_physical_max = 0;
+	int8_t input_unit_exponent = 0;
 };
 
 
@@ -583,12 +949,22 @@ class USBHub : public USBDriver {
 public:
 	USBHub(USBHost &host) : debouncetimer(this), resettimer(this) { init(); }
 	USBHub(USBHost *host) : debouncetimer(this), resettimer(this) { init(); }
-	// Hubs with more more than 7 ports are built from two tiers of hubs
-	// using 4 or 7 port hub chips.  While the USB spec seems to allow
-	// hubs to have up to 255 ports, in practice all hub chips on the
-	// market are only 2, 3, 4 or 7 ports.
-	enum { MAXPORTS = 7 };
-	typedef uint8_t portbitmask_t;
+	// Most hubs with more than 7 ports are built from two tiers of hubs
+	// using 4 or 7 port hub chips, but some industrial hubs have 10 or
+	// 13 ports on a single chip.  While the USB spec allows hubs to have
+	// up to 255 ports, only the first 15 are used here, which keeps the
+	// status change bitmap to 2 bytes.  Only 7 Device_t are contributed
+	// by each hub, since they go to the shared pool and are only used
+	// by ports with a device connected.  Add more with USBHostMemory if
+	// many devices connect to large hubs.  Hubs add no enumeration
+	// buffers; without more from USBHostMemory, devices enumerate one
+	// at a time using the built in buffer.
+	enum { MAXPORTS = 15, DEVICES = 7 };
+	// Port status requests allowed on the control pipe at once.  Each
+	// uses 3 Transfer_t, so 2 fit in the hub's own 10, beside the one
+	// other control transfer and the status change pipe.
+	enum { MAX_GETSTATUS_INFLIGHT = 2 };
+	typedef uint16_t portbitmask_t;
 	enum {
 		PORT_OFF =        0,
 		PORT_DISCONNECT = 1,
@@ -617,23 +993,29 @@ protected:
 	void send_clearstatus_reset(uint32_t port);
 	void send_setreset(uint32_t port);
 	void send_setinterface();
+	void start_next_reset();
 	static void callback(const Transfer_t *transfer);
 	void status_change(const Transfer_t *transfer);
 	void new_port_status(uint32_t port, uint32_t status);
 	void start_debounce_timer(uint32_t port);
 	void stop_debounce_timer(uint32_t port);
 private:
-	Device_t mydevices[MAXPORTS];
-	Pipe_t mypipes[2] __attribute__ ((aligned(32)));
-	Transfer_t mytransfers[4] __attribute__ ((aligned(32)));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	Device_t mydevices[DEVICES];
+	Pipe_t mypipes[2];
+	QH_t myqhs[2] __attribute__ ((aligned(32)));
+	Transfer_t mytransfers[10];
+	qTD_t myqtds[10] __attribute__ ((aligned(32)));
 	strbuf_t mystring_bufs[1];
+#endif
 	USBDriverTimer debouncetimer;
 	USBDriverTimer resettimer;
 	setup_t setup;
 	Pipe_t *changepipe;
 	Device_t *devicelist[MAXPORTS];
 	uint32_t changebits;
-	uint32_t statusbits;
+	setup_t  statussetup[MAXPORTS+1];
+	uint32_t statusbits[MAXPORTS+1];
 	uint8_t  hub_desc[16];
 	uint8_t  interface_count;
 	uint8_t  interface_number;
@@ -641,6 +1023,7 @@ private:
 	uint8_t  protocol;
 	uint8_t  endpoint;
 	uint8_t  interval;
+	uint8_t  changelen;
 	uint8_t  numports;
 	uint8_t  characteristics;
 	uint8_t  powertime;
@@ -648,6 +1031,10 @@ private:
 	uint8_t  port_doing_reset;
 	uint8_t  port_doing_reset_speed;
 	uint8_t  portstate[MAXPORTS];
+#ifdef USBHOST_ENUM_TIMING
+	uint32_t connect_micros[MAXPORTS];
+	uint32_t debounce_micros[MAXPORTS];
+#endif
 	portbitmask_t send_pending_poweron;
 	portbitmask_t send_pending_getstatus;
 	portbitmask_t send_pending_clearstatus_connect;
@@ -656,7 +1043,9 @@ private:
 	portbitmask_t send_pending_clearstatus_overcurrent;
 	portbitmask_t send_pending_clearstatus_reset;
 	portbitmask_t send_pending_setreset;
+	portbitmask_t send_inflight_getstatus;
 	portbitmask_t debounce_in_use;
+	portbitmask_t reset_waiting;
 	static volatile bool reset_busy;
 };
 
@@ -680,9 +1069,72 @@ public:
 	void startTimer(uint32_t microseconds) {hidTimer.start(microseconds);}
 	void stopTimer() {hidTimer.stop();}
 	uint8_t interfaceNumber() { return bInterfaceNumber;}
+	// Reports with a Report ID the descriptor never declared are
+	// dropped without decoding.  This counts them.
+	uint32_t unknownReportIDs() { return unknown_report_ids; }
+	// Count of IN reports received, and the number of times a report
+	// filled the last queued buffer, leaving the device with nowhere
+	// to put the next one until it was parsed.
+	uint32_t receivedReports() { return received_reports; }
+	uint32_t reportOverruns() { return report_overruns; }
+
+	// Output and Feature reports, addressed by usage (usage page in the
+	// upper 16 bits).  The set functions change one field, and the send
+	// functions transmit the whole report which holds that usage.  Only
+	// one control request is in flight at a time.  Until it completes,
+	// reportBusy() is true and the set, send and request functions
+	// return false.
+	bool setOutput(uint32_t usage, int32_t value);
+	bool sendOutput(uint32_t usage);
+	bool setFeature(uint32_t usage, int32_t value);
+	bool sendFeature(uint32_t usage);
+	bool requestFeature(uint32_t usage);
+	int32_t getFeature(uint32_t usage);
+	bool reportBusy() { return setup_busy; }
+
+	// Report descriptors, and the field tables compiled from them, use
+	// memory shared by all HID parsers.  The descriptor is released once
+	// compiled, but kept while the device is connected if its table does
+	// not fit.  Each parser adds 256 bytes, enough for a typical mouse
+	// or keyboard descriptor and its table, and 1024 more are built in.
+	// Programs using devices with larger report descriptors may add
+	// more.  The memory must be 4 byte aligned.
+	static void contribute_Descriptor_Buffer(void *buffer, uint32_t size);
 protected:
-	enum { TOPUSAGE_LIST_LEN = 4 };
+	enum { TOPUSAGE_LIST_LEN = 8 };
 	enum { USAGE_LIST_LEN = 24 };
+	enum { FIELD_LIST_LEN = 255 };		// most entries in each compiled
+	enum { FIELD_USAGE_LEN = 255 };		// table, which are sized for
+	enum { REPORT_FIELD_LIST_LEN = 255 };	// each device's descriptor
+	enum { REPORT_LIST_LEN = 16 };
+	enum { PUSH_STACK_LEN = 4 };
+	enum { REPORT_BUFFER_LIST_LEN = 8 };
+	// One Input item from the report descriptor, compiled so incoming
+	// reports are decoded without walking the descriptor again.
+	typedef struct {
+		uint32_t usage_min;	// first usage, or index into field_usages
+		int32_t  logical_min;
+		int32_t  logical_max;
+		int32_t  physical_min;
+		int32_t  physical_max;
+		uint16_t usage_max;	// last usage of a usage range
+		uint16_t usage_page;
+		uint16_t bitindex;	// first bit, after the report ID byte
+		uint16_t count;		// Report Count
+		uint16_t type;		// Input item data, 2=variable, 0=array
+		uint8_t  size;		// Report Size, 1 to 32 bits
+		uint8_t  usage_list;	// number of usages in field_usages, 0=range
+		uint8_t  collection;	// index into topusage_drivers
+		uint8_t  report;	// index into report_ids
+		int8_t   unit_exponent;
+	} hid_field_t;
+	// Where one Output or Feature report is kept in report_buffer
+	typedef struct {
+		uint8_t  id;		// Report ID, 0 if not used
+		uint8_t  type;		// 0x90=Output, 0xB0=Feature
+		uint8_t  len;		// bytes including Report ID, 0=no space
+		uint16_t offset;
+	} hid_report_buf_t;
 	virtual bool claim(Device_t *device, int type, const uint8_t *descriptors, uint32_t len);
 	virtual void control(const Transfer_t *transfer);
 	virtual void disconnect();
@@ -693,8 +1145,20 @@ protected:
 	void out_data(const Transfer_t *transfer);
 	bool check_if_using_report_id();
 	void parse();
+	void compile();
+	bool compile_usages(hid_field_t *f, const uint16_t *usage, uint32_t usage_count,
+		uint32_t *last_usage);
+	hid_field_t * find_report_field(uint32_t type, uint32_t usage, uint32_t *bitindex);
+	bool set_report_field(uint32_t type, uint32_t usage, int32_t value);
+	bool send_report(uint32_t type, uint32_t usage);
 	USBHIDInput * find_driver(uint32_t topusage);
 	void parse(uint16_t type_and_report_id, const uint8_t *data, uint32_t len);
+	void parse_descriptor(uint16_t type_and_report_id, const uint8_t *data, uint32_t len);
+	static uint8_t * allocate_Descriptor_Buffer(uint32_t len, uint32_t *size);
+	static void free_Descriptor_Buffer(uint8_t *buffer, uint32_t size);
+	void release_descriptor();
+	void release_table();
+	bool queue_setup(Device_t *dev, void *buf);
 	void init();
 
 
@@ -709,14 +1173,51 @@ private:
 	uint16_t in_size;
 	uint16_t out_size;
 	setup_t setup;
-	uint8_t descriptor[800];
-	uint8_t report[64];
-	uint8_t report2[64];
+	volatile bool setup_busy = false;	// a control transfer is using setup
+	uint8_t *descriptor = nullptr;
+	uint32_t descbuf_size = 0;
+	uint8_t *txbuf = nullptr;
+	uint32_t txbuf_size = 0;
+	uint8_t reports[USBHOST_HID_REPORT_BUFFERS][64];
+	uint8_t report_spare;		// the one buffer not queued to in_pipe
+	uint8_t reports_queued;
+	uint32_t received_reports = 0;
+	uint32_t report_overruns = 0;
 	uint16_t descsize;
 	bool use_report_id;
-	Pipe_t mypipes[3] __attribute__ ((aligned(32)));
-	Transfer_t mytransfers[5] __attribute__ ((aligned(32)));
+	bool compiled = false;
+	uint8_t field_count;
+	uint8_t field_usage_count;
+	uint8_t report_list_count;
+	uint8_t report_ids[REPORT_LIST_LEN];
+	uint8_t report_first[REPORT_LIST_LEN+1];
+	uint32_t unknown_report_ids = 0;
+	usb_timestamp_t report_timestamp;
+	uint8_t changes_only;		// collections wanting only changed fields
+	uint16_t history_valid;		// reports with a saved previous report
+	uint16_t history_skip;		// reports dropped if identical to previous
+	uint16_t history_offset[REPORT_LIST_LEN];
+	uint8_t history_len[REPORT_LIST_LEN];
+	uint8_t report_field_count;
+	uint8_t report_buf_count;
+	hid_report_buf_t report_bufs[REPORT_BUFFER_LIST_LEN];
+	uint32_t input_topusage[TOPUSAGE_LIST_LEN];
+	// The compiled tables share one block of descriptor memory
+	uint8_t *table = nullptr;
+	uint32_t table_size = 0;
+	hid_field_t *fields = nullptr;
+	hid_field_t *report_fields = nullptr;
+	uint16_t *field_usages = nullptr;
+	uint8_t *report_buffer = nullptr;
+	uint8_t *report_history = nullptr;
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	Pipe_t mypipes[3];
+	QH_t myqhs[3] __attribute__ ((aligned(32)));
+	Transfer_t mytransfers[USBHOST_HID_REPORT_BUFFERS + 3];
+	qTD_t myqtds[USBHOST_HID_REPORT_BUFFERS + 3] __attribute__ ((aligned(32)));
 	strbuf_t mystring_bufs[1];
+	uint32_t mydescbuf[64];
+#endif
 	uint8_t txstate = 0;
 	uint8_t *tx1 = nullptr;
 	uint8_t *tx2 = nullptr;
@@ -727,6 +1228,84 @@ private:
 
 //--------------------------------------------------------------------------
 
+// Input events, written by the USB interrupt and read by the program.
+// A queue given size entries holds size - 1 events.  When it is full,
+// events are merged by event_merge() into one held back until there
+// is room, and overruns() counts each event which had to wait.
+template <class T>
+class HIDEventQueue {
+public:
+	void begin(T *buffer, uint16_t size) {
+		__disable_irq();
+		queue = (size >= 2) ? buffer : nullptr;
+		queue_size = size;
+		head = 0;
+		tail = 0;
+		held = false;
+		__enable_irq();
+	}
+	bool read(T &event) {
+		if (!queue) return false;
+		uint32_t t = tail;
+		if (t == head) {
+			// the interrupt may still be holding back a merged event
+			bool ret = false;
+			__disable_irq();
+			if (held) {
+				event = held_event;
+				held = false;
+				ret = true;
+			}
+			__enable_irq();
+			return ret;
+		}
+		if (++t >= queue_size) t = 0;
+		event = queue[t];
+		tail = t;
+		return true;
+	}
+	void write(const T &event) {
+		if (!queue) return;
+		if (held) {
+			event_merge(held_event, event);
+		} else {
+			held_event = event;
+			held = true;
+		}
+		uint32_t h = head + 1;
+		if (h >= queue_size) h = 0;
+		if (h == tail) {
+			overrun_count++;
+			return;
+		}
+		queue[h] = held_event;
+		head = h;
+		held = false;
+	}
+	uint32_t overruns() { return overrun_count; }
+private:
+	T *queue = nullptr;
+	uint16_t queue_size = 0;
+	volatile uint16_t head = 0;
+	volatile uint16_t tail = 0;
+	volatile bool held = false;
+	T held_event;
+	uint32_t overrun_count = 0;
+};
+
+// Key presses and releases are transitions, which cannot be combined.
+// While the queue is full, only the newest event is held back.
+typedef struct {
+	uint8_t keycode;	// HID key code, 0xE0 to 0xE7 for modifier keys
+	uint8_t modifiers;	// modifier keys down after this event
+	bool pressed;
+	usb_timestamp_t timestamp;
+} keyboard_event_t;
+
+static inline void event_merge(keyboard_event_t &held, const keyboard_event_t &e) {
+	held = e;
+}
+
 class KeyboardController : public USBDriver , public USBHIDInput, public BTHIDInput {
 public:
 typedef union {
@@ -751,7 +1330,7 @@ public:
 	const uint8_t *product();
 	const uint8_t *serialNumber();
 
-	operator bool() { return ((device != nullptr) || (btdevice != nullptr)); }
+	operator bool() { return ((device != nullptr) || (mydevice != nullptr) || (btdevice != nullptr)); }
 	// Main boot keyboard functions. 
 	uint16_t getKey() { return keyCode; }
 	uint8_t  getModifiers() { return modifiers; }
@@ -775,6 +1354,11 @@ public:
 	void     attachExtrasRelease(void (*f)(uint32_t top, uint16_t code)) { extrasKeyReleasedFunction = f; }
 	void	 forceBootProtocol();
 	enum {MAX_KEYS_DOWN=4};
+	// Optionally keep every key press and release as an event, so none
+	// are lost if the program checks less often than keys change.
+	void	setEventQueue(keyboard_event_t *buffer, uint16_t size) { events.begin(buffer, size); }
+	bool	readEvent(keyboard_event_t &event) { return events.read(event); }
+	uint32_t eventOverruns() { return events.overruns(); }
 
 
 protected:
@@ -801,6 +1385,8 @@ protected:	// HID functions for extra keyboard data.
 
 private:
 	void update();
+	void update_keys(const uint32_t *keys, uint32_t *source);
+	void key_event(uint32_t key, uint32_t mod, bool pressed);
 	uint16_t convert_to_unicode(uint32_t mod, uint32_t key);
 	void key_press(uint32_t mod, uint32_t key);
 	void key_release(uint32_t mod, uint32_t key);
@@ -814,11 +1400,16 @@ private:
 	uint16_t keyCode;
 	uint8_t modifiers;
 	uint8_t keyOEM;
-	uint8_t prev_report[8];
+	uint32_t keys_state[8] = {0};	// key codes down, as a bit set, as last reported
+	uint32_t boot_keys_state[8] = {0};	// keys down in the boot report
 	KBDLeds_t leds_ = {0};
-	Pipe_t mypipes[2] __attribute__ ((aligned(32)));
-	Transfer_t mytransfers[4] __attribute__ ((aligned(32)));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	Pipe_t mypipes[2];
+	QH_t myqhs[2] __attribute__ ((aligned(32)));
+	Transfer_t mytransfers[4];
+	qTD_t myqtds[4] __attribute__ ((aligned(32)));
 	strbuf_t mystring_bufs[1];
+#endif
 
 	// Added to process secondary HID data. 
 	void (*extrasKeyPressedFunction)(uint32_t top, uint16_t code);
@@ -829,10 +1420,34 @@ private:
 	volatile bool hid_input_data_ = false; 	// did we receive any valid data with report?
 	uint8_t count_keys_down_ = 0;
 	uint16_t keys_down[MAX_KEYS_DOWN];
+	uint32_t report_keys[8] = {0};	// keys down in the keyboard collection report
+	uint32_t report_keys_state[8] = {0};	// keys down in the last complete report
+	bool report_keys_valid_ = false;
+	HIDEventQueue<keyboard_event_t> events;
 	bool 	force_boot_protocol;  // User or VID/PID said force boot protocol?
 	bool control_queued;
 };
 
+//--------------------------------------------------------------------------
+
+// Mouse motion and wheels are relative, so merged events add together.
+typedef struct {
+	int32_t x;
+	int32_t y;
+	int16_t wheel;
+	int16_t wheelH;
+	uint8_t buttons;
+	usb_timestamp_t timestamp;
+} mouse_event_t;
+
+static inline void event_merge(mouse_event_t &held, const mouse_event_t &e) {
+	held.x += e.x;
+	held.y += e.y;
+	held.wheel += e.wheel;
+	held.wheelH += e.wheelH;
+	held.buttons = e.buttons;
+	held.timestamp = e.timestamp;
+}
 
 class MouseController : public USBHIDInput, public BTHIDInput {
 public:
@@ -844,6 +1459,11 @@ public:
 	int     getMouseY() { return mouseY; }
 	int     getWheel() { return wheel; }
 	int     getWheelH() { return wheelH; }
+	// Optionally keep every report as an event, so none are lost if
+	// the program checks less often than the mouse sends.
+	void	setEventQueue(mouse_event_t *buffer, uint16_t size) { events.begin(buffer, size); }
+	bool	readEvent(mouse_event_t &event) { return events.read(event); }
+	uint32_t eventOverruns() { return events.overruns(); }
 protected:
 	virtual hidclaim_t claim_collection(USBHIDParser *driver, Device_t *dev, uint32_t topusage);
 	virtual void hid_input_begin(uint32_t topusage, uint32_t type, int lgmin, int lgmax);
@@ -869,10 +1489,24 @@ private:
 	int     mouseY = 0;
 	int     wheel = 0;
 	int     wheelH = 0;
+	mouse_event_t event = {};	// this report's motion, for the event queue
+	HIDEventQueue<mouse_event_t> events;
 };
 
 //--------------------------------------------------------------------------
 
+// Digitizer coordinates are absolute, so merged events keep the newest.
+typedef struct {
+	int32_t x;
+	int32_t y;
+	uint8_t buttons;
+	usb_timestamp_t timestamp;
+} digitizer_event_t;
+
+static inline void event_merge(digitizer_event_t &held, const digitizer_event_t &e) {
+	held = e;
+}
+
 class DigitizerController : public USBHIDInput, public BTHIDInput {
 public:
 	DigitizerController(USBHost &host) { init(); }
@@ -884,6 +1518,11 @@ public:
 	int     getWheel() { return wheel; }
 	int     getWheelH() { return wheelH; }
 	int		getAxis(uint32_t index) { return (index < (sizeof(digiAxes)/sizeof(digiAxes[0]))) ? digiAxes[index] : 0; }
+	// Optionally keep every report as an event, so no touches or
+	// button changes are lost if the program checks less often.
+	void	setEventQueue(digitizer_event_t *buffer, uint16_t size) { events.begin(buffer, size); }
+	bool	readEvent(digitizer_event_t &event) { return events.read(event); }
+	uint32_t eventOverruns() { return events.overruns(); }
 
 protected:
 	virtual hidclaim_t claim_collection(USBHIDParser *driver, Device_t *dev, uint32_t topusage);
@@ -905,11 +1544,26 @@ private:
 	int     wheel = 0;
 	int     wheelH = 0;
 	int     digiAxes[16];
+	HIDEventQueue<digitizer_event_t> events;
 };
 
 
 //--------------------------------------------------------------------------
 
+// Joystick events record button changes.  Merged events keep the newest
+// buttons and every button which changed in either.
+typedef struct {
+	uint32_t buttons;
+	uint32_t changed;
+	usb_timestamp_t timestamp;
+} joystick_event_t;
+
+static inline void event_merge(joystick_event_t &held, const joystick_event_t &e) {
+	held.changed |= e.changed;
+	held.buttons = e.buttons;
+	held.timestamp = e.timestamp;
+}
+
 class JoystickController : public USBDriver, public USBHIDInput, public BTHIDInput {
 public:
 	JoystickController(USBHost &host) { init(); }
@@ -926,6 +1580,11 @@ public:
 	void    joystickDataClear();
 	uint32_t getButtons() { return buttons; }
 	int		getAxis(uint32_t index) { return (index < (sizeof(axis)/sizeof(axis[0]))) ? axis[index] : 0; }
+	// Optionally keep every change of the buttons as an event, so no
+	// presses are lost if the program checks less often.
+	void	setEventQueue(joystick_event_t *buffer, uint16_t size) { events.begin(buffer, size); }
+	bool	readEvent(joystick_event_t &event) { return events.read(event); }
+	uint32_t eventOverruns() { return events.overruns(); }
 	uint64_t axisMask() {return axis_mask_;}
 	uint64_t axisChangedMask() { return axis_changed_mask_;}
 	uint64_t axisChangeNotifyMask() {return axis_change_notify_mask_;}
@@ -961,6 +1620,7 @@ protected:
 	virtual void disconnect_collection(Device_t *dev);
 	virtual bool hid_process_out_data(const Transfer_t *transfer);
 	virtual bool hid_process_in_data(const Transfer_t *transfer);
+	virtual bool hid_changed_fields_only() { return true; }
 
 		// Bluetooth data
 	virtual bool claim_bluetooth(BluetoothController *driver, uint32_t bluetooth_class, uint8_t *remoteName);
@@ -974,6 +1634,7 @@ private:
 
 	// Class specific
 	void init();
+	void queue_button_event();
 	USBHIDParser *driver_ = nullptr;
 	BluetoothController *btdriver_ = nullptr;
 
@@ -986,6 +1647,8 @@ private:
 	bool anychange = false;
 	volatile bool joystickEvent = false;
 	uint32_t buttons = 0;
+	uint32_t event_buttons = 0;	// buttons as last given to the event queue
+	HIDEventQueue<joystick_event_t> events;
 	int axis[TOTAL_AXIS_COUNT] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 	uint64_t axis_mask_ = 0;	// which axis have valid data
 	uint64_t axis_changed_mask_ = 0;
@@ -1012,9 +1675,13 @@ private:
 	void rx_data(const Transfer_t *transfer);
 	void tx_data(const Transfer_t *transfer);
 
-	Pipe_t mypipes[3] __attribute__ ((aligned(32)));
-	Transfer_t mytransfers[7] __attribute__ ((aligned(32)));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	Pipe_t mypipes[3];
+	QH_t myqhs[3] __attribute__ ((aligned(32)));
+	Transfer_t mytransfers[7];
+	qTD_t myqtds[7] __attribute__ ((aligned(32)));
 	strbuf_t mystring_bufs[1];
+#endif
 
 	uint8_t			rx_ep_ = 0;	// remember which end point this object is...
 	uint16_t 		rx_size_ = 0;
@@ -1197,6 +1864,12 @@ public:
 	uint8_t getCable(void) {
 		return msg_cable;
 	}
+	// When the USB packet holding the last message read arrived.  While
+	// 8 packets are already waiting to be read, more packets share the
+	// timestamp of the newest of those 8.
+	const usb_timestamp_t & getTimestamp(void) {
+		return msg_timestamp;
+	}
 	uint8_t getChannel(void) {
 		return msg_channel;
 	};
@@ -1338,6 +2011,13 @@ private:
 	const uint16_t rx_queue_size;
 	uint16_t rx_head;
 	uint16_t rx_tail;
+	// timestamp of each received packet, with rx_queue index of its last message
+	enum { RX_STAMP_LEN = 8 };
+	uint16_t rx_stamp_end[RX_STAMP_LEN];
+	usb_timestamp_t rx_stamp[RX_STAMP_LEN];
+	volatile uint8_t rx_stamp_head;
+	volatile uint8_t rx_stamp_tail;
+	usb_timestamp_t msg_timestamp;
 	volatile uint8_t tx1_count;
 	volatile uint8_t tx2_count;
 	uint8_t rx_ep;
@@ -1371,9 +2051,13 @@ private:
 	void (*handleActiveSensing)(void);
 	void (*handleSystemReset)(void);
 	void (*handleRealTimeSystem)(uint8_t rtb);
-	Pipe_t mypipes[3] __attribute__ ((aligned(32)));
-	Transfer_t mytransfers[7] __attribute__ ((aligned(32)));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	Pipe_t mypipes[3];
+	QH_t myqhs[3] __attribute__ ((aligned(32)));
+	Transfer_t mytransfers[7];
+	qTD_t myqtds[7] __attribute__ ((aligned(32)));
 	strbuf_t mystring_bufs[1];
+#endif
 };
 
 class MIDIDevice : public MIDIDeviceBase {
@@ -1456,9 +2140,13 @@ private:
 	bool init_buffers(uint32_t rsize, uint32_t tsize);
 	void ch341_setBaud(uint8_t byte_index);
 private:
-	Pipe_t mypipes[3] __attribute__ ((aligned(32)));
-	Transfer_t mytransfers[7] __attribute__ ((aligned(32)));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	Pipe_t mypipes[3];
+	QH_t myqhs[3] __attribute__ ((aligned(32)));
+	Transfer_t mytransfers[7];
+	qTD_t myqtds[7] __attribute__ ((aligned(32)));
 	strbuf_t mystring_bufs[1];
+#endif
 	USBDriverTimer txtimer;
 	uint32_t *_bigBuffer;
 	uint16_t _big_buffer_size;
@@ -1581,9 +2269,13 @@ private:
 	int read(void *data, const size_t size);
 	void transmit();
 private:
-	Pipe_t mypipes[2] __attribute__ ((aligned(32)));
-	Transfer_t mytransfers[3] __attribute__ ((aligned(32)));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	Pipe_t mypipes[2];
+	QH_t myqhs[2] __attribute__ ((aligned(32)));
+	Transfer_t mytransfers[3];
+	qTD_t myqtds[3] __attribute__ ((aligned(32)));
 	strbuf_t mystring_bufs[1];
+#endif
 	//USBDriverTimer txtimer;
 	USBDriverTimer updatetimer;
 	Pipe_t *rxpipe;
@@ -1777,7 +2469,10 @@ private:
 	uint32_t usage_ = 0;
 
 	// See if we can contribute transfers
-	Transfer_t mytransfers[2] __attribute__ ((aligned(32)));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	Transfer_t mytransfers[2];
+	qTD_t myqtds[2] __attribute__ ((aligned(32)));
+#endif
 
 };
 
@@ -1839,7 +2534,10 @@ private:
 
 
 	// See if we can contribute transfers
-	Transfer_t mytransfers[2] __attribute__ ((aligned(32)));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	Transfer_t mytransfers[2];
+	qTD_t myqtds[2] __attribute__ ((aligned(32)));
+#endif
 
 };
 
@@ -1969,9 +2667,13 @@ private:
 
 
 	setup_t setup;
-	Pipe_t mypipes[4] __attribute__ ((aligned(32)));
-	Transfer_t mytransfers[7] __attribute__ ((aligned(32)));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	Pipe_t mypipes[4];
+	QH_t myqhs[4] __attribute__ ((aligned(32)));
+	Transfer_t mytransfers[7];
+	qTD_t myqtds[7] __attribute__ ((aligned(32)));
 	strbuf_t mystring_bufs[2];		// 2 string buffers - one for our device - one for remote device...
+#endif
 	uint16_t 		pending_control_ = 0;
 	uint16_t		pending_control_tx_ = 0;
 	uint16_t 		rx_size_ = 0;
@@ -2043,8 +2745,12 @@ private:
 	char *version;
 	char *uri;
 	char *serial;
-	Pipe_t mypipes[3] __attribute__ ((aligned(32)));
-	Transfer_t mytransfers[7] __attribute__ ((aligned(32)));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	Pipe_t mypipes[3];
+	QH_t myqhs[3] __attribute__ ((aligned(32)));
+	Transfer_t mytransfers[7];
+	qTD_t myqtds[7] __attribute__ ((aligned(32)));
+#endif
 };
 
 //--------------------------------------------------------------------------
@@ -2098,9 +2804,13 @@ protected:
 	uint8_t msDoCommand(msCommandBlockWrapper_t *CBW, void *buffer);
 	uint8_t msGetCSW(void);
 private:
-	Pipe_t mypipes[3] __attribute__ ((aligned(32)));
-	Transfer_t mytransfers[7] __attribute__ ((aligned(32)));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	Pipe_t mypipes[3];
+	QH_t myqhs[3] __attribute__ ((aligned(32)));
+	Transfer_t mytransfers[7];
+	qTD_t myqtds[7] __attribute__ ((aligned(32)));
 	strbuf_t mystring_bufs[1];
+#endif
 	uint32_t packetSizeIn;
 	uint32_t packetSizeOut;
 	Pipe_t *datapipeIn;
@@ -54,13 +54,24 @@ static setup_t adksetup __attribute__ ((aligned(16)));
 //  Initialization and claiming of devices & interfaces
 /************************************************************/
 
+// Vendor specific interface of ADK or ADB devices
+static const driver_match_t adk_match[] = {
+	{driver_match_t::INTERFACE, driver_match_t::VENDOR | driver_match_t::PRODUCT
+		| driver_match_t::CLASS | driver_match_t::SUBCLASS, ADK_VID, ADK_PID, 255, 255, 0},
+	{driver_match_t::INTERFACE, driver_match_t::VENDOR | driver_match_t::PRODUCT
+		| driver_match_t::CLASS | driver_match_t::SUBCLASS, ADK_VID, ADB_PID, 255, 255, 0}
+};
+
 void ADK::init()
 {
-	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	contribute_Pipes(mypipes, myqhs, sizeof(mypipes)/sizeof(Pipe_t));
+	contribute_Transfers(mytransfers, myqtds, sizeof(mytransfers)/sizeof(Transfer_t));
+#endif
 	
 	rx_head = 0;
 	rx_tail = 0;
+	match_table(adk_match, sizeof(adk_match)/sizeof(driver_match_t));
 	driver_ready_for_device(this);
 	
 	state = 0;
@@ -301,7 +312,7 @@ void ADK::tx_callback(const Transfer_t *transfer)
 
 void ADK::rx_data(const Transfer_t *transfer)
 {
-	uint32_t len = transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF);
+	uint32_t len = transfer->length - ((transfer->qtd->token >> 16) & 0x7FFF);
 	
 	println("ADK Receive rx_data");
 	print("Len: ");
@@ -49,11 +49,21 @@
 #endif
 
 
+static const driver_match_t antplus_match[] = {
+	{driver_match_t::INTERFACE, driver_match_t::VENDOR | driver_match_t::PRODUCT,
+		ANTPLUS_VID, ANTPLUS_2_PID, 0, 0, 0},
+	{driver_match_t::INTERFACE, driver_match_t::VENDOR | driver_match_t::PRODUCT,
+		ANTPLUS_VID, ANTPLUS_M_PID, 0, 0, 0}
+};
+
 void AntPlus::init()
 {
-	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	contribute_Pipes(mypipes, myqhs, sizeof(mypipes)/sizeof(Pipe_t));
+	contribute_Transfers(mytransfers, myqtds, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+#endif
+	match_table(antplus_match, sizeof(antplus_match)/sizeof(driver_match_t));
 	driver_ready_for_device(this);
 	user_onStatusChange = NULL;
 	user_onDeviceID = NULL;
@@ -134,7 +144,7 @@ void AntPlus::tx_callback(const Transfer_t *transfer)
 
 void AntPlus::rx_data(const Transfer_t *transfer)
 {
-	uint32_t len = transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF);
+	uint32_t len = transfer->length - ((transfer->qtd->token >> 16) & 0x7FFF);
 	//println("ant rx, len=", len);
 	//print_hexbytes(transfer->buffer, len);
 	if (len < 1 || len > 64) {
@@ -198,11 +198,21 @@ BluetoothController::product_vendor_mapping_t BluetoothController::pid_vid_mappi
 //  Initialization and claiming of devices & interfaces
 /************************************************************/
 
+// Bluetooth Programming Interface, or special case devices in pid_vid_mapping
+static const driver_match_t bluetooth_match[] = {
+	{driver_match_t::DEVICE, driver_match_t::CLASS | driver_match_t::SUBCLASS
+		| driver_match_t::PROTOCOL, 0, 0, 0xE0, 1, 1}
+};
+
 void BluetoothController::init()
 {
-	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	contribute_Pipes(mypipes, myqhs, sizeof(mypipes)/sizeof(Pipe_t));
+	contribute_Transfers(mytransfers, myqtds, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+#endif
+	match_table(bluetooth_match, sizeof(bluetooth_match)/sizeof(driver_match_t));
+	match_ids(pid_vid_mapping, driver_match_t::DEVICE);
 	driver_ready_for_device(this);
 }
 
@@ -372,7 +382,7 @@ void BluetoothController::tx_callback(const Transfer_t *transfer)
 
 void BluetoothController::rx_data(const Transfer_t *transfer)
 {
-	uint32_t len = transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF);
+	uint32_t len = transfer->length - ((transfer->qtd->token >> 16) & 0x7FFF);
 	print_hexbytes((uint8_t*)transfer->buffer, len);
 //	DBGPrintf("<<(00 : %d): ", len);
 	DBGPrintf("<<(01):");
@@ -1021,7 +1031,7 @@ void BluetoothController::handle_hci_remote_version_information_complete() {
 
 void BluetoothController::rx2_data(const Transfer_t *transfer)
 {
-	uint32_t len = transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF);
+	uint32_t len = transfer->length - ((transfer->qtd->token >> 16) & 0x7FFF);
 	DBGPrintf("\n=====================\n<<(02):");
 	uint8_t *buffer = (uint8_t*)transfer->buffer;
 	for (uint8_t i=0; i < len; i++) DBGPrintf("%02X ", buffer[i]);
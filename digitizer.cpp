@@ -121,6 +121,12 @@ void DigitizerController::hid_input_end()
 	if (hid_input_begin_) {
 		digitizerEvent = true;
 		hid_input_begin_ = false;
+		digitizer_event_t event;
+		event.x = mouseX;
+		event.y = mouseY;
+		event.buttons = buttons;
+		event.timestamp = input_timestamp;
+		events.write(event);
 	}
 }
 
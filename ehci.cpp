@@ -30,7 +30,8 @@
 //
 //   Pipe_t: Every USB endpoint is accessed by a pipe.  new_Pipe()
 //     sets up the EHCI to support the pipe/endpoint, and delete_Pipe()
-//     removes this configuration.
+//     removes this configuration.  The EHCI sees only the pipe's
+//     QH_t, which is kept in separate DMA memory.
 //
 //   Transfer_t: These are used for all communication.  Data transfers
 //     are placed into work queues, to be executed by the EHCI in
@@ -39,7 +40,8 @@
 //     which is referenced from Transfer_t.  All data transfer is queued,
 //     never done with blocking functions that wait.  When transfers
 //     complete, a driver-supplied callback function is called to notify
-//     the driver.
+//     the driver.  Each Transfer_t is paired with the qTD_t the EHCI
+//     actually executes.
 //
 //   USBDriverTimer: Some drivers require timers.  These allow drivers
 //     to share the hardware timer, with each USBDriverTimer object
@@ -94,12 +96,21 @@ static Transfer_t *periodic_followup_last=NULL;
 static USBDriverTimer *active_timers=NULL;
 
 
-static void init_qTD(volatile Transfer_t *t, void *buf, uint32_t len,
+static void init_qTD(volatile qTD_t *t, void *buf, uint32_t len,
               uint32_t pid, uint32_t data01, bool irq);
 static void add_to_async_followup_list(Transfer_t *first, Transfer_t *last);
 static void remove_from_async_followup_list(Transfer_t *transfer);
 static void add_to_periodic_followup_list(Transfer_t *first, Transfer_t *last);
 static void remove_from_periodic_followup_list(Transfer_t *transfer);
+static void free_interrupt_pipe_bandwidth(const Pipe_t *pipe);
+
+// Schedule links point to QH_t in DMA memory.  Each QH keeps a pointer
+// back to its Pipe_t, in space the EHCI does not use.
+static inline Pipe_t * link_to_pipe(uint32_t link)
+{
+	QH_t *qh = (QH_t *)(link & 0xFFFFFFE0);
+	return qh ? qh->pipe : NULL;
+}
 
 #define print   USBHost::print_
 #define println USBHost::println_
@@ -115,13 +126,17 @@ void USBHost::begin()
 	println("sizeof Device = ", sizeof(Device_t));
 	println("sizeof Pipe = ", sizeof(Pipe_t));
 	println("sizeof Transfer = ", sizeof(Transfer_t));
-	if ((sizeof(Pipe_t) & 0x1F) || (sizeof(Transfer_t) & 0x1F)) {
-		println("ERROR: Pipe_t & Transfer_t must be multiples of 32 bytes!");
+	if ((sizeof(QH_t) & 0x1F) || (sizeof(qTD_t) & 0x1F)) {
+		println("ERROR: QH_t & qTD_t must be multiples of 32 bytes!");
 		while (1) ; // die here
 	}
 
 	// configure the MPU to allow USBHS DMA to access memory
 	MPU_RGDAAC0 |= 0x30000000;
+
+	// cycle counter, for timestamps of completed transfers
+	ARM_DEMCR |= ARM_DEMCR_TRCENA;
+	ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
 	//println("MPU_RGDAAC0 = ", MPU_RGDAAC0, HEX);
 
 	// turn on clocks
@@ -300,6 +315,13 @@ void USBHost::begin()
 // PORT_STATE_ACTIVE         4
 
 
+// Turn off the root port, when its device could not be enumerated.
+// It is enabled again by the reset after the next connect.
+void USBHost::disable_root_port(void)
+{
+	USBHS_PORTSC1 = USBHS_PORTSC1 & ~(USBHS_PORTSC_PE|USBHS_PORTSC_OCC|USBHS_PORTSC_PEC|USBHS_PORTSC_CSC);
+}
+
 void USBHost::isr()
 {
 	uint32_t stat = USBHS_USBSTS;
@@ -376,6 +398,12 @@ void USBHost::isr()
 		if (portstat & USBHS_PORTSC_CSC) {
 			if (portstat & USBHS_PORTSC_CCS) {
 				println("    connect");
+#ifdef USBHOST_ENUM_TIMING
+				if (port_state == PORT_STATE_DISCONNECTED) {
+					memset(&port_timing, 0, sizeof(port_timing));
+					port_timing.usec[enum_timing_t::CONNECT] = micros();
+				}
+#endif
 				if (port_state == PORT_STATE_DISCONNECTED
 				  || port_state == PORT_STATE_DEBOUNCE) {
 					// 100 ms debounce (USB 2.0: TATTDB, page 150 & 188)
@@ -399,6 +427,9 @@ void USBHost::isr()
 		} else if (port_state == PORT_STATE_RESET && portstat & USBHS_PORTSC_PE) {
 			println("  port enabled");
 			port_state = PORT_STATE_RECOVERY;
+#ifdef USBHOST_ENUM_TIMING
+			port_timing.usec[enum_timing_t::RECOVERY] = micros();
+#endif
 			// 10 ms reset recover (USB 2.0: TRSTRCY, page 151 & 188)
 			USBHS_GPTIMER0LD = 10000; // microseconds
 			USBHS_GPTIMER0CTL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
@@ -423,6 +454,10 @@ void USBHost::isr()
 			// enumerating a device.
 			USBHS_PORTSC1 |= USBHS_PORTSC_PR; // begin reset sequence
 			println("  begin reset");
+#ifdef USBHOST_ENUM_TIMING
+			port_timing.usec[enum_timing_t::DEBOUNCE] = micros();
+			port_timing.usec[enum_timing_t::RESET] = port_timing.usec[enum_timing_t::DEBOUNCE];
+#endif
 		} else if (port_state == PORT_STATE_RECOVERY) {
 			port_state = PORT_STATE_ACTIVE;
 			println("  end recovery");
@@ -592,13 +627,22 @@ Pipe_t * USBHost::new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint,
 		free_Pipe(pipe);
 		return NULL;
 	}
+	QH_t *qh = pipe->qh;
 	memset(pipe, 0, sizeof(Pipe_t));
+	memset(qh, 0, sizeof(QH_t));
+	pipe->qh = qh;
+	qh->pipe = pipe;
+	qTD_t *qtd = halt->qtd;
 	memset(halt, 0, sizeof(Transfer_t));
-	halt->qtd.next = 1;
-	halt->qtd.token = 0x40;
+	memset(qtd, 0, sizeof(qTD_t));
+	halt->qtd = qtd;
+	halt->pipe = pipe;
+	qtd->next = 1;
+	qtd->token = 0x40;
 	pipe->device = dev;
-	pipe->qh.next = (uint32_t)halt;
-	pipe->qh.alt_next = 1;
+	pipe->halt = halt;
+	qh->next = (uint32_t)qtd;
+	qh->alt_next = 1;
 	pipe->direction = direction;
 	pipe->type = type;
 	if (type == 3) {
@@ -627,26 +671,26 @@ Pipe_t * USBHost::new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint,
 		// bulk
 	} else if (type == 3) {
 		// interrupt
-		//pipe->qh.token = 0x80000000; // TODO: OUT starts with DATA0 or DATA1?
+		//qh->token = 0x80000000; // TODO: OUT starts with DATA0 or DATA1?
 	}
-	pipe->qh.capabilities[0] = QH_capabilities1(15, c, maxlen, 0,
+	qh->capabilities[0] = QH_capabilities1(15, c, maxlen, 0,
 		dtc, dev->speed, endpoint, 0, dev->address);
-	pipe->qh.capabilities[1] = QH_capabilities2(1, dev->hub_port,
+	qh->capabilities[1] = QH_capabilities2(1, dev->hub_port,
 		dev->hub_address, pipe->complete_mask, pipe->start_mask);
 
 	if (type == 0 || type == 2) {
 		// control or bulk: add to async queue
-		Pipe_t *list = (Pipe_t *)USBHS_ASYNCLISTADDR;
+		QH_t *list = (QH_t *)USBHS_ASYNCLISTADDR;
 		if (list == NULL) {
-			pipe->qh.capabilities[0] |= 0x8000; // H bit
-			pipe->qh.horizontal_link = (uint32_t)&(pipe->qh) | 2; // 2=QH
-			USBHS_ASYNCLISTADDR = (uint32_t)&(pipe->qh);
+			qh->capabilities[0] |= 0x8000; // H bit
+			qh->horizontal_link = (uint32_t)qh | 2; // 2=QH
+			USBHS_ASYNCLISTADDR = (uint32_t)qh;
 			USBHS_USBCMD |= USBHS_USBCMD_ASE; // enable async schedule
 			//println("  first in async list");
 		} else {
 			// EHCI 1.0: section 4.8.1, page 72
-			pipe->qh.horizontal_link = list->qh.horizontal_link;
-			list->qh.horizontal_link = (uint32_t)&(pipe->qh) | 2;
+			qh->horizontal_link = list->horizontal_link;
+			list->horizontal_link = (uint32_t)qh | 2;
 			//println("  added to async list");
 		}
 	} else if (type == 3) {
@@ -659,26 +703,26 @@ Pipe_t * USBHost::new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint,
 
 
 // Fill in the qTD fields (token & data)
-//   t       the Transfer qTD to initialize
+//   t       the qTD to initialize
 //   buf     data to transfer
 //   len     length of data
 //   pid     type of packet: 0=OUT, 1=IN, 2=SETUP
 //   data01  value of DATA0/DATA1 toggle on 1st packet
 //   irq     whether to generate an interrupt when transfer complete
 //
-static void init_qTD(volatile Transfer_t *t, void *buf, uint32_t len,
+static void init_qTD(volatile qTD_t *t, void *buf, uint32_t len,
               uint32_t pid, uint32_t data01, bool irq)
 {
-	t->qtd.alt_next = 1; // 1=terminate
+	t->alt_next = 1; // 1=terminate
 	if (data01) data01 = 0x80000000;
-	t->qtd.token = data01 | (len << 16) | (irq ? 0x8000 : 0) | (pid << 8) | 0x80;
+	t->token = data01 | (len << 16) | (irq ? 0x8000 : 0) | (pid << 8) | 0x80;
 	uint32_t addr = (uint32_t)buf;
-	t->qtd.buffer[0] = addr;
+	t->buffer[0] = addr;
 	addr &= 0xFFFFF000;
-	t->qtd.buffer[1] = addr + 0x1000;
-	t->qtd.buffer[2] = addr + 0x2000;
-	t->qtd.buffer[3] = addr + 0x3000;
-	t->qtd.buffer[4] = addr + 0x4000;
+	t->buffer[1] = addr + 0x1000;
+	t->buffer[2] = addr + 0x2000;
+	t->buffer[3] = addr + 0x3000;
+	t->buffer[4] = addr + 0x4000;
 }
 
 
@@ -712,24 +756,102 @@ bool USBHost::queue_Control_Transfer(Device_t *dev, setup_t *setup, void *buf, U
 			return false;
 		}
 		uint32_t pid = (setup->bmRequestType & 0x80) ? 1 : 0;
-		init_qTD(data, buf, setup->wLength, pid, 1, false);
-		transfer->qtd.next = (uint32_t)data;
-		data->qtd.next = (uint32_t)status;
+		init_qTD(data->qtd, buf, setup->wLength, pid, 1, false);
+		transfer->qtd->next = (uint32_t)data->qtd;
+		transfer->next_followup = data;
+		data->qtd->next = (uint32_t)status->qtd;
+		data->next_followup = status;
 		status_direction = pid ^ 1;
 	} else {
-		transfer->qtd.next = (uint32_t)status;
+		transfer->qtd->next = (uint32_t)status->qtd;
+		transfer->next_followup = status;
 		status_direction = 1; // always IN, USB 2.0 page 226
 	}
 	//println("setup address ", (uint32_t)setup, HEX);
-	init_qTD(transfer, setup, 8, 2, 0, false);
-	init_qTD(status, NULL, 0, status_direction, 1, true);
+	init_qTD(transfer->qtd, setup, 8, 2, 0, false);
+	init_qTD(status->qtd, NULL, 0, status_direction, 1, true);
 	status->pipe = dev->control_pipe;
 	status->buffer = buf;
 	status->length = setup->wLength;
 	status->setup.word1 = setup->word1;
 	status->setup.word2 = setup->word2;
 	status->driver = driver;
-	status->qtd.next = 1;
+	status->qtd->next = 1;
+	status->next_followup = NULL;
+	return queue_Transfer(dev->control_pipe, transfer);
+}
+
+
+// Create a Control Transfer which reads more than its buffer can hold.
+// Only the data after offset is kept.  The data stage is split into
+// qTDs which all write to the same buffer, up to 512 bytes each, so
+// the data before offset is overwritten by the data which follows.
+// offset must be a multiple of 128, so each qTD ends after an even
+// number of packets and the next begins with DATA1.
+//
+// USB can not read from an offset, so every window reads all the data
+// before it again.  Reading a long descriptor this way takes time which
+// grows with the square of its length, and the discarded data needs one
+// Transfer_t per 512 bytes.  Windows must end within the first
+// CONTROL_WINDOW_MAX bytes, which limits each request to 11 Transfer_t
+// and reading a whole descriptor to a few dozen kbytes of traffic.
+//
+#define CONTROL_WINDOW_MAX 4096
+
+bool USBHost::queue_Control_Window(Device_t *dev, setup_t *setup, void *buf,
+	uint32_t offset, USBDriver *driver)
+{
+	Transfer_t *transfer, *data, *next, *status;
+	uint32_t len = setup->wLength;
+
+	if (len > CONTROL_WINDOW_MAX) {
+		println("  control window beyond ", CONTROL_WINDOW_MAX);
+		return false;
+	}
+	if (offset >= len || (offset & 127)) return false;
+	if (!(setup->bmRequestType & 0x80)) return false; // IN only
+	// allocate qTDs: setup, discarded data, kept data, status
+	transfer = allocate_Transfer();
+	if (!transfer) return false;
+	data = transfer;
+	for (uint32_t count=((offset + 511) >> 9) + 2; count; count--) {
+		next = allocate_Transfer();
+		if (!next) {
+			// free already-allocated qTDs
+			println("  error allocating control window transfer");
+			while (1) {
+				next = transfer->next_followup;
+				free_Transfer(transfer);
+				if (transfer == data) break;
+				transfer = next;
+			}
+			return false;
+		}
+		data->qtd->next = (uint32_t)next->qtd;
+		data->next_followup = next;
+		data = next;
+	}
+	status = data;
+	status->qtd->next = 1;
+	status->next_followup = NULL;
+	// initialize all qTDs
+	init_qTD(transfer->qtd, setup, 8, 2, 0, false);
+	data = transfer->next_followup;
+	while (offset > 0) {
+		uint32_t count = (offset > 512) ? 512 : offset;
+		init_qTD(data->qtd, buf, count, 1, 1, false);
+		offset -= count;
+		len -= count;
+		data = data->next_followup;
+	}
+	init_qTD(data->qtd, buf, len, 1, 1, false);
+	init_qTD(status->qtd, NULL, 0, 0, 1, true);
+	status->pipe = dev->control_pipe;
+	status->buffer = buf;
+	status->length = len;
+	status->setup.word1 = setup->word1;
+	status->setup.word2 = setup->word2;
+	status->driver = driver;
 	return queue_Transfer(dev->control_pipe, transfer);
 }
 
@@ -755,18 +877,20 @@ bool USBHost::queue_Data_Transfer(Pipe_t *pipe, void *buffer, uint32_t len, USBD
 		if (!next) {
 			// free already-allocated qTDs
 			while (1) {
-				next = (Transfer_t *)transfer->qtd.next;
+				next = transfer->next_followup;
 				free_Transfer(transfer);
 				if (transfer == data) break;
 				transfer = next;
 			}
                         return false;
                 }
-		data->qtd.next = (uint32_t)next;
+		data->qtd->next = (uint32_t)next->qtd;
+		data->next_followup = next;
 		data = next;
 	}
 	// last qTD needs info for followup
-	data->qtd.next = 1;
+	data->qtd->next = 1;
+	data->next_followup = NULL;
 	data->pipe = pipe;
 	data->buffer = buffer;
 	data->length = len;
@@ -782,56 +906,58 @@ bool USBHost::queue_Data_Transfer(Pipe_t *pipe, void *buffer, uint32_t len, USBD
 		} else {
 			last = true;
 		}
-		init_qTD(data, p, count, pipe->direction, 0, last);
+		init_qTD(data->qtd, p, count, pipe->direction, 0, last);
 		if (last) break;
 		p += count;
 		len -= count;
-		data = (Transfer_t *)(data->qtd.next);
+		data = data->next_followup;
 	}
 	return queue_Transfer(pipe, transfer);
 }
 
 
+// Add a list of new transfers (linked by next_followup) to a pipe.
+// The pipe's inactive halt qTD takes the place of the first transfer
+// and the first transfer becomes the new halt qTD, so the whole list
+// is committed to the QH by a single write of the old halt's token.
 bool USBHost::queue_Transfer(Pipe_t *pipe, Transfer_t *transfer)
 {
-	// find halt qTD
-	Transfer_t *halt = (Transfer_t *)(pipe->qh.next);
-	while (!(halt->qtd.token & 0x40)) halt = (Transfer_t *)(halt->qtd.next);
+	Transfer_t *halt = pipe->halt;
 	// transfer's token
-	uint32_t token = transfer->qtd.token;
+	uint32_t token = transfer->qtd->token;
 	// transfer becomes new halt qTD
-	transfer->qtd.token = 0x40;
+	transfer->qtd->token = 0x40;
 	// copy transfer non-token fields to halt
-	halt->qtd.next = transfer->qtd.next;
-	halt->qtd.alt_next = transfer->qtd.alt_next;
-	halt->qtd.buffer[0] = transfer->qtd.buffer[0]; // TODO: optimize memcpy, all
-	halt->qtd.buffer[1] = transfer->qtd.buffer[1]; //       fields except token
-	halt->qtd.buffer[2] = transfer->qtd.buffer[2];
-	halt->qtd.buffer[3] = transfer->qtd.buffer[3];
-	halt->qtd.buffer[4] = transfer->qtd.buffer[4];
+	halt->qtd->next = transfer->qtd->next;
+	halt->qtd->alt_next = transfer->qtd->alt_next;
+	halt->qtd->buffer[0] = transfer->qtd->buffer[0]; // TODO: optimize memcpy, all
+	halt->qtd->buffer[1] = transfer->qtd->buffer[1]; //       fields except token
+	halt->qtd->buffer[2] = transfer->qtd->buffer[2];
+	halt->qtd->buffer[3] = transfer->qtd->buffer[3];
+	halt->qtd->buffer[4] = transfer->qtd->buffer[4];
+	halt->next_followup = transfer->next_followup;
 	halt->pipe = pipe;
 	halt->buffer = transfer->buffer;
 	halt->length = transfer->length;
 	halt->setup = transfer->setup;
 	halt->driver = transfer->driver;
-	// find the last qTD we're adding
-	Transfer_t *last = halt;
-	while ((uint32_t)(last->qtd.next) != 1) last = (Transfer_t *)(last->qtd.next);
-	// last points to transfer (which becomes new halt)
-	last->qtd.next = (uint32_t)transfer;
-	transfer->qtd.next = 1;
-	// link all the new qTD by next_followup & prev_followup
+	// link all the new qTD by prev_followup, find the last one
 	Transfer_t *prev = NULL;
 	Transfer_t *p = halt;
-	while (p->qtd.next != (uint32_t)transfer) {
-		Transfer_t *next = (Transfer_t *)p->qtd.next;
+	while (1) {
+		p->pipe = pipe;
 		p->prev_followup = prev;
-		p->next_followup = next;
+		if (p->next_followup == NULL) break;
 		prev = p;
-		p = next;
+		p = p->next_followup;
 	}
-	p->prev_followup = prev;
-	p->next_followup = NULL;
+	// last points to transfer (which becomes new halt)
+	p->qtd->next = (uint32_t)transfer->qtd;
+	transfer->qtd->next = 1;
+	transfer->qtd->alt_next = 1;
+	transfer->next_followup = NULL;
+	transfer->pipe = pipe;
+	pipe->halt = transfer;
 	//print(halt, p);
 	// add them to a followup list
 	if (pipe->type == 0 || pipe->type == 2) {
@@ -842,19 +968,21 @@ bool USBHost::queue_Transfer(Pipe_t *pipe, Transfer_t *transfer)
 		add_to_periodic_followup_list(halt, p);
 	}
 	// old halt becomes new transfer, this commits all new qTDs to QH
-	halt->qtd.token = token;
+	halt->qtd->token = token;
 	return true;
 }
 
 bool USBHost::followup_Transfer(Transfer_t *transfer)
 {
 	//print("  Followup ", (uint32_t)transfer, HEX);
-	//println("    token=", transfer->qtd.token, HEX);
+	//println("    token=", transfer->qtd->token, HEX);
 
-	if (!(transfer->qtd.token & 0x80)) {
+	if (!(transfer->qtd->token & 0x80)) {
 		// TODO: check error status
-		if (transfer->qtd.token & 0x8000) {
+		if (transfer->qtd->token & 0x8000) {
 			// this transfer caused an interrupt
+			transfer->timestamp.frindex = USBHS_FRINDEX;
+			transfer->timestamp.cycles = ARM_DWT_CYCCNT;
 			if (transfer->pipe->callback_function) {
 				// do the callback
 				(*(transfer->pipe->callback_function))(transfer);
@@ -877,7 +1005,7 @@ void USBHost::followup_Error(void)
 			Transfer_t *next = p->next_followup;
 			remove_from_async_followup_list(p);
 			println("    remove from followup list");
-			if (p->qtd.token & 0x40) {
+			if (p->qtd->token & 0x40) {
 				Pipe_t *haltedpipe = p->pipe;
 				free_Transfer(p);
 				// traverse the rest of the list for unfinished work
@@ -903,25 +1031,13 @@ void USBHost::followup_Error(void)
 					p = next2;
 				}
 				// halted pipe (probably) still has unfinished transfers
-				// find the halted pipe's dummy halt transfer
-				p = (Transfer_t *)(haltedpipe->qh.next & ~0x1F);
-				while (p && ((p->qtd.token & 0x40) == 0)) {
-					print("  qtd: ", (uint32_t)p, HEX);
-					print(", token=", (uint32_t)p->qtd.token, HEX);
-					println(", next=", (uint32_t)p->qtd.next, HEX);
-					p = (Transfer_t *)(p->qtd.next & ~0x1F);
-				}
-				if (p) {
-					// unhalt the pipe, "forget" unfinished transfers
-					// hopefully they're all on the list we made!
-					println("  dummy halt: ", (uint32_t)p, HEX);
-					haltedpipe->qh.next = (uint32_t)p;
-					haltedpipe->qh.current = 0;
-					haltedpipe->qh.token = 0;
-				} else {
-					println("  no dummy halt found, yikes!");
-					// TODO: this should never happen, but what if it does?
-				}
+				// unhalt the pipe, "forget" unfinished transfers
+				// hopefully they're all on the list we made!
+				p = haltedpipe->halt;
+				println("  dummy halt: ", (uint32_t)p, HEX);
+				haltedpipe->qh->next = (uint32_t)p->qtd;
+				haltedpipe->qh->current = 0;
+				haltedpipe->qh->token = 0;
 
 				// Do any driver callbacks belonging to the unfinished
 				// transfers.  This is done last, after retoring the
@@ -929,10 +1045,10 @@ void USBHost::followup_Error(void)
 				// callback can use the pipe.
 				p = first;
 				while (p) {
-					uint32_t token = p->qtd.token;
+					uint32_t token = p->qtd->token;
 					if (token & 0x8000 && haltedpipe->callback_function) {
 						// driver expects a callback
-						p->qtd.token = token | 0x40;
+						p->qtd->token = token | 0x40;
 						(*(p->pipe->callback_function))(p);
 					}
 					Transfer_t *next2 = p->next_followup;
@@ -1188,6 +1304,106 @@ bool USBHost::allocate_interrupt_pipe_bandwidth(Pipe_t *pipe, uint32_t maxlen, u
 	return true;
 }
 
+// Subtract an interrupt pipe's bandwidth from the uframe_bandwidth array
+//
+static void free_interrupt_pipe_bandwidth(const Pipe_t *pipe)
+{
+	if (pipe->device->speed == 2) {
+		uint32_t interval = pipe->bandwidth_interval;
+		uint32_t offset = pipe->bandwidth_offset;
+		uint32_t stime = pipe->bandwidth_stime;
+		for (uint32_t i=offset; i < PERIODIC_LIST_SIZE*8; i += interval) {
+			uframe_bandwidth[i] -= stime;
+		}
+	} else {
+		uint32_t interval = pipe->bandwidth_interval;
+		uint32_t offset = pipe->bandwidth_offset;
+		uint32_t shift = pipe->bandwidth_shift;
+		uint32_t stime = pipe->bandwidth_stime;
+		uint32_t ctime = pipe->bandwidth_ctime;
+		for (uint32_t i=offset; i < PERIODIC_LIST_SIZE; i += interval) {
+			uint32_t n = (i << 3) + shift;
+			uframe_bandwidth[n+0] -= stime;
+			uframe_bandwidth[n+2] -= ctime;
+			uframe_bandwidth[n+3] -= ctime;
+			uframe_bandwidth[n+4] -= ctime;
+		}
+	}
+}
+
+// Switch an interface to another alternate setting.  The pipes a driver
+// created for the old setting are deleted, but only after checking the
+// interrupt endpoints of the new setting can fit into the periodic
+// schedule, so a device is never switched to a setting its driver
+// can't use.  Returns false, with nothing changed, if they do not fit
+// or the request can not be queued.
+//   desc:    interface descriptor of the new setting, with its endpoints
+//   pipes:   pipes of the old setting, set to NULL when deleted
+//   setup:   SET_INTERFACE request, must remain valid until complete
+//   driver:  its control() function is called when SET_INTERFACE
+//            completes, and then it may create the new pipes
+//
+bool USBHost::set_interface(Device_t *dev, const uint8_t *desc, uint32_t len,
+	Pipe_t **pipes, uint32_t num, setup_t *setup, USBDriver *driver)
+{
+	static uint8_t saved_bandwidth[PERIODIC_LIST_SIZE*8];
+
+	if (len < 9 || desc[0] < 9 || desc[1] != 4) return false;
+	println("set_interface ", desc[2]);
+	println("  altsetting = ", desc[3]);
+	// try the new endpoints as if the old pipes were already gone
+	memcpy(saved_bandwidth, uframe_bandwidth, sizeof(uframe_bandwidth));
+	for (uint32_t i=0; i < num; i++) {
+		if (pipes[i] && pipes[i]->type == 3) free_interrupt_pipe_bandwidth(pipes[i]);
+	}
+	bool fits = true;
+	const uint8_t *p = desc + desc[0];
+	const uint8_t *end = desc + len;
+	while (p + 2 <= end) {
+		if (p[0] < 2 || p + p[0] > end) break;
+		if (p[1] == 4 || p[1] == 11) break; // next interface or IAD
+		if (p[1] == 5 && p[0] >= 7 && (p[3] & 3) == 3) {
+			// interrupt endpoint, with high bandwidth packets per uframe
+			uint32_t maxlen = p[4] | ((p[5] & 7) << 8);
+			maxlen *= ((p[5] >> 3) & 3) + 1;
+			Pipe_t pipe;
+			memset(&pipe, 0, sizeof(pipe));
+			pipe.device = dev;
+			pipe.direction = p[2] >> 7;
+			if (!allocate_interrupt_pipe_bandwidth(&pipe, maxlen, p[6])) {
+				println("  not enough bandwidth");
+				fits = false;
+				break;
+			}
+		}
+		p += p[0];
+	}
+	memcpy(uframe_bandwidth, saved_bandwidth, sizeof(uframe_bandwidth));
+	if (!fits) return false;
+	// queue the request before removing the old pipes, so they are
+	// kept if it can not be queued.  SET_INTERFACE takes at least a
+	// frame on the bus, long after the pipes are gone.
+	mk_setup(*setup, 0x01, 11, desc[3], desc[2], 0); // 11=SET_INTERFACE
+	if (!queue_Control_Transfer(dev, setup, NULL, driver)) return false;
+	for (uint32_t i=0; i < num; i++) {
+		Pipe_t *pipe = pipes[i];
+		if (!pipe) continue;
+		if (dev->data_pipes == pipe) {
+			dev->data_pipes = pipe->next;
+		} else {
+			for (Pipe_t *prev = dev->data_pipes; prev; prev = prev->next) {
+				if (prev->next == pipe) {
+					prev->next = pipe->next;
+					break;
+				}
+			}
+		}
+		delete_Pipe(pipe);
+		pipes[i] = NULL;
+	}
+	return true;
+}
+
 // put a new pipe into the periodic schedule tree
 // according to periodic_interval and periodic_offset
 //
@@ -1196,8 +1412,8 @@ void USBHost::add_qh_to_periodic_schedule(Pipe_t *pipe)
 	// quick hack for testing, just put it into the first table entry
 	//println("add_qh_to_periodic_schedule: ", (uint32_t)pipe, HEX);
 #if 0
-	pipe->qh.horizontal_link = periodictable[0];
-	periodictable[0] = (uint32_t)&(pipe->qh) | 2; // 2=QH
+	pipe->qh->horizontal_link = periodictable[0];
+	periodictable[0] = (uint32_t)pipe->qh | 2; // 2=QH
 	println("init periodictable with ", periodictable[0], HEX);
 #else
 	uint32_t interval = pipe->periodic_interval;
@@ -1209,13 +1425,13 @@ void USBHost::add_qh_to_periodic_schedule(Pipe_t *pipe)
 	for (uint32_t i=offset; i < PERIODIC_LIST_SIZE; i += interval) {
 		//print("    old slot ", i);
 		//print(": ");
-		//print_qh_list((Pipe_t *)(periodictable[i] & 0xFFFFFFE0));
+		//print_qh_list(link_to_pipe(periodictable[i]));
 		uint32_t num = periodictable[i];
-		Pipe_t *node = (Pipe_t *)(num & 0xFFFFFFE0);
+		Pipe_t *node = link_to_pipe(num);
 		if ((num & 1) || ((num & 6) == 2 && node->periodic_interval < interval)) {
 			//println("  add to slot ", i);
-			pipe->qh.horizontal_link = num;
-			periodictable[i] = (uint32_t)&(pipe->qh) | 2; // 2=QH
+			pipe->qh->horizontal_link = num;
+			periodictable[i] = (uint32_t)pipe->qh | 2; // 2=QH
 		} else {
 			//println("  traverse list ", i);
 			// TODO: skip past iTD, siTD when/if we support isochronous
@@ -1223,21 +1439,21 @@ void USBHost::add_qh_to_periodic_schedule(Pipe_t *pipe)
 				if (node == pipe) goto nextslot;
 				//print("  num ", num, HEX);
 				//print("  node ", (uint32_t)node, HEX);
-				//println("->", node->qh.horizontal_link, HEX);
-				if (node->qh.horizontal_link & 1) break;
-				num = node->qh.horizontal_link;
-				node = (Pipe_t *)(num & 0xFFFFFFE0);
+				//println("->", node->qh->horizontal_link, HEX);
+				if (node->qh->horizontal_link & 1) break;
+				num = node->qh->horizontal_link;
+				node = link_to_pipe(num);
 			}
 			Pipe_t *n = node;
 			do {
 				if (n == pipe) goto nextslot;
-				n = (Pipe_t *)(n->qh.horizontal_link & 0xFFFFFFE0);
+				n = link_to_pipe(n->qh->horizontal_link);
 			} while (n != NULL);
 			//print("  adding at node ", (uint32_t)node, HEX);
 			//print(", num=", num, HEX);
-			//println(", node->qh.horizontal_link=", node->qh.horizontal_link, HEX);
-			pipe->qh.horizontal_link = node->qh.horizontal_link;
-			node->qh.horizontal_link = (uint32_t)pipe | 2; // 2=QH
+			//println(", node->qh->horizontal_link=", node->qh->horizontal_link, HEX);
+			pipe->qh->horizontal_link = node->qh->horizontal_link;
+			node->qh->horizontal_link = (uint32_t)pipe->qh | 2; // 2=QH
 			// TODO: is it really necessary to keep doing the outer
 			// loop?  Does adding it here satisfy all cases?  If so
 			// we could avoid extra work by just returning here.
@@ -1245,7 +1461,7 @@ void USBHost::add_qh_to_periodic_schedule(Pipe_t *pipe)
 		nextslot:
 		//print("    new slot ", i);
 		//print(": ");
-		//print_qh_list((Pipe_t *)(periodictable[i] & 0xFFFFFFE0));
+		//print_qh_list(link_to_pipe(periodictable[i]));
 		{}
 	}
 #endif
@@ -1255,7 +1471,7 @@ void USBHost::add_qh_to_periodic_schedule(Pipe_t *pipe)
 		if (i < 10) print(" ");
 		print(i);
 		print(": ");
-		print_qh_list((Pipe_t *)(periodictable[i] & 0xFFFFFFE0));
+		print_qh_list(link_to_pipe(periodictable[i]));
 	}
 #endif
 }
@@ -1283,7 +1499,7 @@ void USBHost::delete_Pipe(Pipe_t *pipe)
 	bool isasync = (pipe->type == 0 || pipe->type == 2);
 	if (isasync) {
 		// find the next QH in the async schedule loop
-		Pipe_t *next = (Pipe_t *)(pipe->qh.horizontal_link & 0xFFFFFFE0);
+		Pipe_t *next = link_to_pipe(pipe->qh->horizontal_link);
 		if (next == pipe) {
 			// removing the only QH, so just shut down the async schedule
 			println("  shut down async schedule");
@@ -1295,16 +1511,16 @@ void USBHost::delete_Pipe(Pipe_t *pipe)
 			println("  remove QH from async schedule");
 			Pipe_t *prev = next;
 			while (1) {
-				Pipe_t *n = (Pipe_t *)(prev->qh.horizontal_link & 0xFFFFFFE0);
+				Pipe_t *n = link_to_pipe(prev->qh->horizontal_link);
 				if (n == pipe) break;
 				prev = n;
 			}
 			// if removing the one with H bit, set another
-			if (pipe->qh.capabilities[0] & 0x8000) {
-				prev->qh.capabilities[0] |= 0x8000; // set H bit
+			if (pipe->qh->capabilities[0] & 0x8000) {
+				prev->qh->capabilities[0] |= 0x8000; // set H bit
 			}
 			// link the previous QH, we're no longer in the loop
-			prev->qh.horizontal_link = pipe->qh.horizontal_link;
+			prev->qh->horizontal_link = pipe->qh->horizontal_link;
 			// do the Async Advance Doorbell handshake to wait to be
 			// sure the EHCI no longer references the removed QH
 			USBHS_USBCMD |= USBHS_USBCMD_IAA;
@@ -1312,27 +1528,16 @@ void USBHost::delete_Pipe(Pipe_t *pipe)
 			USBHS_USBSTS = USBHS_USBSTS_AAI;
 			// TODO: does this write interfere UPI & UAI (bits 18 & 19) ??
 		}
-		// find & free all the transfers which completed
+		// find & free all the transfers still queued on this pipe
 		println("  Free transfers");
 		Transfer_t *t = async_followup_first;
 		while (t) {
 			print("    * ", (uint32_t)t);
 			Transfer_t *next = t->next_followup;
 			if (t->pipe == pipe) {
-				print(" * remove");
+				println(" * free");
 				remove_from_async_followup_list(t);
-
-				// Only free if not in QH list
-				Transfer_t *tr = (Transfer_t *)(pipe->qh.next);
-				while (((uint32_t)tr & 0xFFFFFFE0) && (tr != t)){
-					tr  = (Transfer_t *)(tr->qtd.next);
-				}
-				if (tr == t) {
-					println(" * defer free until QH");
-				} else {
-					println(" * free");
-					free_Transfer(t);  // The later code should actually free it...
-				}
+				free_Transfer(t);
 			} else {
 				println("");
 			}
@@ -1343,67 +1548,36 @@ void USBHost::delete_Pipe(Pipe_t *pipe)
 		for (uint32_t i=0; i < PERIODIC_LIST_SIZE; i++) {
 			uint32_t num = periodictable[i];
 			if (num & 1) continue;
-			Pipe_t *node = (Pipe_t *)(num & 0xFFFFFFE0);
+			Pipe_t *node = link_to_pipe(num);
 			if (node == pipe) {
-				periodictable[i] = pipe->qh.horizontal_link;
+				periodictable[i] = pipe->qh->horizontal_link;
 				continue;
 			}
 			Pipe_t *prev = node;
 			while (1) {
-				num = node->qh.horizontal_link;
+				num = node->qh->horizontal_link;
 				if (num & 1) break;
-				node = (Pipe_t *)(num & 0xFFFFFFE0);
+				node = link_to_pipe(num);
 				if (node == pipe) {
-					prev->qh.horizontal_link = node->qh.horizontal_link;
+					prev->qh->horizontal_link = node->qh->horizontal_link;
 					break;
 				}
 				prev = node;
 			}
 		}
 		// subtract bandwidth from uframe_bandwidth array
-		if (pipe->device->speed == 2) {
-			uint32_t interval = pipe->bandwidth_interval;
-			uint32_t offset = pipe->bandwidth_offset;
-			uint32_t stime = pipe->bandwidth_stime;
-			for (uint32_t i=offset; i < PERIODIC_LIST_SIZE*8; i += interval) {
-				uframe_bandwidth[i] -= stime;
-			}
-		} else {
-			uint32_t interval = pipe->bandwidth_interval;
-			uint32_t offset = pipe->bandwidth_offset;
-			uint32_t shift = pipe->bandwidth_shift;
-			uint32_t stime = pipe->bandwidth_stime;
-			uint32_t ctime = pipe->bandwidth_ctime;
-			for (uint32_t i=offset; i < PERIODIC_LIST_SIZE; i += interval) {
-				uint32_t n = (i << 3) + shift;
-				uframe_bandwidth[n+0] -= stime;
-				uframe_bandwidth[n+2] -= ctime;
-				uframe_bandwidth[n+3] -= ctime;
-				uframe_bandwidth[n+4] -= ctime;
-			}
-		}
+		free_interrupt_pipe_bandwidth(pipe);
 
-		// find & free all the transfers which completed
+		// find & free all the transfers still queued on this pipe
 		println("  Free transfers");
 		Transfer_t *t = periodic_followup_first;
 		while (t) {
 			print("    * ", (uint32_t)t);
 			Transfer_t *next = t->next_followup;
 			if (t->pipe == pipe) {
-				print(" * remove");
+				println(" * free");
 				remove_from_periodic_followup_list(t);
-
-				// Only free if not in QH list
-				Transfer_t *tr = (Transfer_t *)(pipe->qh.next);
-				while (((uint32_t)tr & 0xFFFFFFE0) && (tr != t)){
-					tr  = (Transfer_t *)(tr->qtd.next);
-				}
-				if (tr == t) {
-					println(" * defer free until QH");
-				} else {
-					println(" * free");
-					free_Transfer(t);  // The later code should actually free it...
-				}
+				free_Transfer(t);
 			} else {
 				println("");
 			}
@@ -1411,18 +1585,12 @@ void USBHost::delete_Pipe(Pipe_t *pipe)
 		}
 	}
 	//
-	// TODO: do we need to look at pipe->qh.current ??
+	// TODO: do we need to look at pipe->qh->current ??
 	//
-	// free all the transfers still attached to the QH
-	println("  Free transfers attached to QH");
-	Transfer_t *tr = (Transfer_t *)(pipe->qh.next);
-	while ((uint32_t)tr & 0xFFFFFFE0) {
-		println("    * ", (uint32_t)tr);
-		Transfer_t *next = (Transfer_t *)(tr->qtd.next);
-		free_Transfer(tr);
-		tr = next;
-	}
-	// hopefully we found everything...
+	// every queued transfer is on a followup list until it completes,
+	// so only the inactive halt qTD remains attached to the QH
+	println("  Free halt transfer ", (uint32_t)pipe->halt, HEX);
+	free_Transfer(pipe->halt);
 	free_Pipe(pipe);
 	println("* Delete Pipe completed");
 }
@@ -41,22 +41,62 @@ static Device_t  *devlist=NULL;
 // devices.
 static USBDriver *available_drivers = NULL;
 
-// Static buffers used during enumeration.  One a single USB device
-// may enumerate at once, because USB address zero is used, and
-// because this static buffer & state info can't be shared.
-static uint8_t enumbuf[512] __attribute__ ((aligned(16)));
-static setup_t enumsetup __attribute__ ((aligned(16)));
-static uint16_t enumlen;
-
-// True while any device is present but not yet fully configured.
-// Only one USB device may be in this state at a time (responding
-// to address zero) and using the enumeration static buffer.
+// Buffers for enumeration.  Each device uses one from new_Device until
+// its drivers are claimed.  One is built in, more are contributed by
+// hubs or USBHostMemory, so devices behind different hub ports can
+// enumerate at the same time.
+static enum_buffer_t enumbuf0;
+static enum_buffer_t *free_enum_buffers = &enumbuf0;
+
+// Only one device at a time may respond to address zero.  This is the
+// device which has not yet completed SET_ADDRESS, or NULL.
+static Device_t *address0_dev = NULL;
+
+// True while another port may not reset, because a device is using
+// address zero, or no enumeration buffer is free for the next device.
 volatile bool USBHost::enumeration_busy = false;
 
+#ifdef USBHOST_ENUM_TIMING
+enum_timing_t USBHost::port_timing;
+#endif
+
+// When string descriptors are not read during enumeration, they are
+// read later into this buffer.  Only one device at a time may use it,
+// and other devices wait for their turn with strings_pending = 2.
+static uint8_t stringbuf[256] __attribute__ ((aligned(16)));
+static setup_t stringsetup __attribute__ ((aligned(16)));
+static Device_t *stringdev = NULL;
+uint8_t USBHost::string_mode = USBHost::STRINGS_DURING_ENUMERATION;
+
+// Addresses in use, 1 bit for each.  Address 0 is never assigned.
+static uint32_t address_bitmap[4] = {1, 0, 0, 0};
+
+// Current the host port may supply, in mA
+uint16_t USBHost::power_budget = 500;
+
+// Attach and detach events, waiting for the program to read them.
+// They are added at interrupt level and read by the program.
+#define HOTPLUG_QUEUE_SIZE 8
+static hotplug_event_t hotplug_queue[HOTPLUG_QUEUE_SIZE];
+static volatile uint8_t hotplug_head = 0;
+static volatile uint8_t hotplug_tail = 0;
+static uint8_t hotplug_lost = 0;
+void (*USBHost::hotplug_callback)(const hotplug_event_t &event) = NULL;
+
+// Descriptors of recently connected devices, most recently used first.
+static descriptor_cache_t *desc_cache = NULL;
+static uint32_t desc_cache_hits = 0;
+static uint32_t desc_cache_misses = 0;
+
 
 
 static void pipe_set_maxlen(Pipe_t *pipe, uint32_t maxlen);
+static void free_address(uint32_t addr);
 static void pipe_set_addr(Pipe_t *pipe, uint32_t addr);
+static descriptor_cache_t * find_cached_descriptors(const Device_t *dev, const uint8_t *serial);
+static void save_cached_descriptors(const Device_t *dev);
+static void free_enum_buffer(Device_t *dev);
+static void use_cached_descriptors(descriptor_cache_t *entry);
 
 #define print   USBHost::print_
 #define println USBHost::println_
@@ -66,6 +106,12 @@ static void pipe_set_addr(Pipe_t *pipe, uint32_t addr);
 // call all the active driver Task() functions.
 void USBHost::Task()
 {
+	if (hotplug_callback) {
+		hotplug_event_t event;
+		while (getHotplugEvent(event)) {
+			(*hotplug_callback)(event);
+		}
+	}
 	for (Device_t *dev = devlist; dev; dev = dev->next) {
 		for (USBDriver *driver = dev->drivers; driver; driver = driver->next) {
 			(driver->Task)();
@@ -98,6 +144,7 @@ void USBHost::driver_ready_for_device(USBDriver *driver)
 Device_t * USBHost::new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_port)
 {
 	Device_t *dev;
+	enum_buffer_t *e;
 
 	print("new_Device: ");
 	switch (speed) {
@@ -107,15 +154,27 @@ Device_t * USBHost::new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_p
 	  default: print("??");
 	}
 	println(" Mbit/sec");
+	if (address0_dev != NULL) return NULL; // address zero in use
+	e = free_enum_buffers;
+	if (!e) return NULL;
 	dev = allocate_Device();
 	if (!dev) return NULL;
+	free_enum_buffers = e->next;
 	memset(dev, 0, sizeof(Device_t));
+	memset(e, 0, sizeof(enum_buffer_t));
+	dev->enumbuf = e;
 	dev->speed = speed;
 	dev->address = 0;
 	dev->hub_address = hub_addr;
 	dev->hub_port = hub_port;
+#ifdef USBHOST_ENUM_TIMING
+	dev->timing = port_timing;
+	memset(&port_timing, 0, sizeof(port_timing));
+#endif
+	enum_timing(dev, enum_timing_t::ENUMERATE);
 	dev->control_pipe = new_Pipe(dev, 0, 0, 0, 8);
 	if (!dev->control_pipe) {
+		free_enum_buffer(dev);
 		free_Device(dev);
 		return NULL;
 	}
@@ -123,10 +182,11 @@ Device_t * USBHost::new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_p
 	dev->control_pipe->callback_function = &enumeration;
 	dev->control_pipe->direction = 1; // 1=IN
 	// Here is where the enumeration process officially begins.
-	// Only a single device can enumerate at a time.
+	// Until this device has its address, no other port may reset.
+	address0_dev = dev;
 	USBHost::enumeration_busy = true;
-	mk_setup(enumsetup, 0x80, 6, 0x0100, 0, 8); // 6=GET_DESCRIPTOR
-	queue_Control_Transfer(dev, &enumsetup, enumbuf, NULL);
+	mk_setup(e->setup, 0x80, 6, 0x0100, 0, 8); // 6=GET_DESCRIPTOR
+	queue_Control_Transfer(dev, &e->setup, e->buf, NULL);
 	if (devlist == NULL) {
 		devlist = dev;
 	} else {
@@ -159,6 +219,17 @@ void USBHost::enumeration(const Transfer_t *transfer)
 	//print_hexbytes(transfer->buffer, transfer->length);
 	//print(transfer);
 	dev = transfer->pipe->device;
+	enum_buffer_t *e = dev->enumbuf;
+	// a hub port disabled by enumeration_failed() needs nothing more
+	if (transfer->setup.bmRequestType == 0x23) return;
+
+	// String descriptors read after enumeration use their own buffer,
+	// since the device no longer has an enumeration buffer.
+	bool deferred = (dev == stringdev);
+	if (!deferred && e == NULL) return;
+	uint8_t *strdesc = deferred ? stringbuf : e->buf + 4;
+	setup_t *strsetup = deferred ? &stringsetup : &e->setup;
+	uint32_t strdone = deferred ? 16 : 11;
 
 	while (1) {
 		// Within this large switch/case, "break" means we've done
@@ -170,121 +241,247 @@ void USBHost::enumeration(const Transfer_t *transfer)
 		// enumeration is complete and no more communication is needed.
 		switch (dev->enum_state) {
 		case 0: // read 8 bytes of device desc, set max packet, and send set address
-			pipe_set_maxlen(dev->control_pipe, enumbuf[7]);
-			mk_setup(enumsetup, 0, 5, assign_address(), 0, 0); // 5=SET_ADDRESS
-			queue_Control_Transfer(dev, &enumsetup, NULL, NULL);
+			pipe_set_maxlen(dev->control_pipe, e->buf[7]);
+			len = assign_address();
+			if (len == 0) {
+				println("no USB address available");
+				enumeration_failed(dev);
+				return;
+			}
+			mk_setup(e->setup, 0, 5, len, 0, 0); // 5=SET_ADDRESS
+			queue_Control_Transfer(dev, &e->setup, NULL, NULL);
 			dev->enum_state = 1;
 			return;
 		case 1: // request all 18 bytes of device descriptor
-			dev->address = enumsetup.wValue;
-			pipe_set_addr(dev->control_pipe, enumsetup.wValue);
-			mk_setup(enumsetup, 0x80, 6, 0x0100, 0, 18); // 6=GET_DESCRIPTOR
-			queue_Control_Transfer(dev, &enumsetup, enumbuf, NULL);
+			dev->address = e->setup.wValue;
+			pipe_set_addr(dev->control_pipe, e->setup.wValue);
+			// address zero is free, so the next port may reset now
+			address0_dev = NULL;
+			USBHost::enumeration_busy = (free_enum_buffers == NULL);
+			mk_setup(e->setup, 0x80, 6, 0x0100, 0, 18); // 6=GET_DESCRIPTOR
+			queue_Control_Transfer(dev, &e->setup, e->buf, NULL);
 			dev->enum_state = 2;
 			return;
 		case 2: // parse 18 device desc bytes
-			print_device_descriptor(enumbuf);
-			dev->bDeviceClass = enumbuf[4];
-			dev->bDeviceSubClass = enumbuf[5];
-			dev->bDeviceProtocol = enumbuf[6];
-			dev->idVendor = enumbuf[8] | (enumbuf[9] << 8);
-			dev->idProduct = enumbuf[10] | (enumbuf[11] << 8);
-			enumbuf[0] = enumbuf[14];
-			enumbuf[1] = enumbuf[15];
-			enumbuf[2] = enumbuf[16];
-			if ((enumbuf[0] | enumbuf[1] | enumbuf[2]) > 0) {
+			enum_timing(dev, enum_timing_t::DEVICE_DESC);
+			print_device_descriptor(e->buf);
+			dev->bDeviceClass = e->buf[4];
+			dev->bDeviceSubClass = e->buf[5];
+			dev->bDeviceProtocol = e->buf[6];
+			dev->idVendor = e->buf[8] | (e->buf[9] << 8);
+			dev->idProduct = e->buf[10] | (e->buf[11] << 8);
+			dev->bcdDevice = e->buf[12] | (e->buf[13] << 8);
+			dev->string_index[0] = e->buf[14];
+			dev->string_index[1] = e->buf[15];
+			dev->string_index[2] = e->buf[16];
+			dev->bNumConfigurations = e->buf[17];
+			e->config = 0;
+			// look for this device's descriptors from an earlier connection
+			e->cache = find_cached_descriptors(dev, NULL);
+			if (e->cache) {
+				if (dev->string_index[2]) dev->enum_state = 17;
+				else dev->enum_state = 11;
+			} else {
+				dev->enum_state = 19;
+			}
+			break;
+		case 17: // request Serial Number, to check cache
+			len = sizeof(e->buf) - 4;
+			mk_setup(e->setup, 0x80, 6, 0x0300 | dev->string_index[2], e->cache->LanguageID, len);
+			queue_Control_Transfer(dev, &e->setup, e->buf + 4, NULL);
+			dev->enum_state = 18;
+			return;
+		case 18: // parse Serial Number, find cached descriptors
+			e->cache = find_cached_descriptors(dev, e->buf + 4);
+			if (e->cache) dev->enum_state = 11;
+			else dev->enum_state = 19;
+			break;
+		case 19: // decide whether to read strings now
+			if ((dev->string_index[0] | dev->string_index[1] | dev->string_index[2]) == 0) {
+				dev->enum_state = 11;
+			} else if (string_mode == STRINGS_DURING_ENUMERATION) {
 				dev->enum_state = 3;
 			} else {
+				// skip strings now, read them after configuration
+				dev->strings_pending = 1;
 				dev->enum_state = 11;
 			}
 			break;
 		case 3: // request Language ID
-			len = sizeof(enumbuf) - 4;
-			mk_setup(enumsetup, 0x80, 6, 0x0300, 0, len); // 6=GET_DESCRIPTOR
-			queue_Control_Transfer(dev, &enumsetup, enumbuf + 4, NULL);
+			len = deferred ? sizeof(stringbuf) : sizeof(e->buf) - 4;
+			mk_setup(*strsetup, 0x80, 6, 0x0300, 0, len); // 6=GET_DESCRIPTOR
+			queue_Control_Transfer(dev, strsetup, strdesc, NULL);
 			dev->enum_state = 4;
 			return;
 		case 4: // parse Language ID
-			if (enumbuf[4] < 4 || enumbuf[5] != 3) {
-				dev->enum_state = 11;
+			if (strdesc[0] < 4 || strdesc[1] != 3) {
+				dev->enum_state = strdone;
 			} else {
-				dev->LanguageID = enumbuf[6] | (enumbuf[7] << 8);
-				if (enumbuf[0]) dev->enum_state = 5;
-				else if (enumbuf[1]) dev->enum_state = 7;
-				else if (enumbuf[2]) dev->enum_state = 9;
-				else dev->enum_state = 11;
+				dev->LanguageID = strdesc[2] | (strdesc[3] << 8);
+				if (dev->string_index[0]) dev->enum_state = 5;
+				else if (dev->string_index[1]) dev->enum_state = 7;
+				else if (dev->string_index[2]) dev->enum_state = 9;
+				else dev->enum_state = strdone;
 			}
 			break;
 		case 5: // request Manufacturer string
-			len = sizeof(enumbuf) - 4;
-			mk_setup(enumsetup, 0x80, 6, 0x0300 | enumbuf[0], dev->LanguageID, len);
-			queue_Control_Transfer(dev, &enumsetup, enumbuf + 4, NULL);
+			len = deferred ? sizeof(stringbuf) : sizeof(e->buf) - 4;
+			mk_setup(*strsetup, 0x80, 6, 0x0300 | dev->string_index[0], dev->LanguageID, len);
+			queue_Control_Transfer(dev, strsetup, strdesc, NULL);
 			dev->enum_state = 6;
 			return;
 		case 6: // parse Manufacturer string
-			print_string_descriptor("Manufacturer: ", enumbuf + 4);
+			print_string_descriptor("Manufacturer: ", strdesc);
 			convertStringDescriptorToASCIIString(0, dev, transfer);
 			// TODO: receive the string...
-			if (enumbuf[1]) dev->enum_state = 7;
-			else if (enumbuf[2]) dev->enum_state = 9;
-			else dev->enum_state = 11;
+			if (dev->string_index[1]) dev->enum_state = 7;
+			else if (dev->string_index[2]) dev->enum_state = 9;
+			else dev->enum_state = strdone;
 			break;
 		case 7: // request Product string
-			len = sizeof(enumbuf) - 4;
-			mk_setup(enumsetup, 0x80, 6, 0x0300 | enumbuf[1], dev->LanguageID, len);
-			queue_Control_Transfer(dev, &enumsetup, enumbuf + 4, NULL);
+			len = deferred ? sizeof(stringbuf) : sizeof(e->buf) - 4;
+			mk_setup(*strsetup, 0x80, 6, 0x0300 | dev->string_index[1], dev->LanguageID, len);
+			queue_Control_Transfer(dev, strsetup, strdesc, NULL);
 			dev->enum_state = 8;
 			return;
 		case 8: // parse Product string
-			print_string_descriptor("Product: ", enumbuf + 4);
+			print_string_descriptor("Product: ", strdesc);
 			convertStringDescriptorToASCIIString(1, dev, transfer);
-			if (enumbuf[2]) dev->enum_state = 9;
-			else dev->enum_state = 11;
+			if (dev->string_index[2]) dev->enum_state = 9;
+			else dev->enum_state = strdone;
 			break;
 		case 9: // request Serial Number string
-			len = sizeof(enumbuf) - 4;
-			mk_setup(enumsetup, 0x80, 6, 0x0300 | enumbuf[2], dev->LanguageID, len);
-			queue_Control_Transfer(dev, &enumsetup, enumbuf + 4, NULL);
+			len = deferred ? sizeof(stringbuf) : sizeof(e->buf) - 4;
+			mk_setup(*strsetup, 0x80, 6, 0x0300 | dev->string_index[2], dev->LanguageID, len);
+			queue_Control_Transfer(dev, strsetup, strdesc, NULL);
 			dev->enum_state = 10;
 			return;
 		case 10: // parse Serial Number string
-			print_string_descriptor("Serial Number: ", enumbuf + 4);
+			print_string_descriptor("Serial Number: ", strdesc);
 			convertStringDescriptorToASCIIString(2, dev, transfer);
-			dev->enum_state = 11;
+			dev->enum_state = strdone;
 			break;
 		case 11: // request first 9 bytes of config desc
-			mk_setup(enumsetup, 0x80, 6, 0x0200, 0, 9); // 6=GET_DESCRIPTOR
-			queue_Control_Transfer(dev, &enumsetup, enumbuf, NULL);
+			enum_timing(dev, enum_timing_t::STRINGS);
+			if (dev->bNumConfigurations > 1 && e->config < dev->bNumConfigurations) {
+				// first read every configuration, for drivers to choose
+				mk_setup(e->setup, 0x80, 6, 0x0200 | e->config, 0, sizeof(e->buf));
+				queue_Control_Transfer(dev, &e->setup, e->buf, NULL);
+				dev->enum_state = 21;
+				return;
+			}
+			mk_setup(e->setup, 0x80, 6, 0x0200 | dev->config_index, 0, 9); // 6=GET_DESCRIPTOR
+			queue_Control_Transfer(dev, &e->setup, e->buf, NULL);
 			dev->enum_state = 12;
 			return;
+		case 21: // read one of several configurations, ask drivers
+			len = e->buf[2] | (e->buf[3] << 8);
+			if (len > sizeof(e->buf)) len = sizeof(e->buf);
+			if (len >= 9 && e->buf[1] == 2) {
+				uint32_t preference = rate_configuration(dev, e->buf, len);
+				println("Config ", e->config, DEC);
+				println("  preference = ", preference);
+				if (e->config == 0 || preference > e->preference) {
+					dev->config_index = e->config;
+					e->preference = preference;
+				}
+			}
+			e->config++;
+			dev->enum_state = 11;
+			break;
 		case 12: // read 9 bytes, request all of config desc
-			enumlen = enumbuf[2] | (enumbuf[3] << 8);
-			println("Config data length = ", enumlen);
-			if (enumlen > sizeof(enumbuf)) {
-				enumlen = sizeof(enumbuf);
-				// TODO: how to handle device with too much config data
+			e->len = e->buf[2] | (e->buf[3] << 8);
+			println("Config data length = ", e->len);
+			e->total = e->len;
+			e->offset = 0;
+			e->parse = 9;
+			if (e->cache) {
+				if (e->len == e->cache->config_len
+				  && memcmp(e->buf, e->cache->config, 9) == 0) {
+					// cached descriptors are still valid, use them
+					println("Using cached descriptors");
+					memcpy(e->buf, e->cache->config, e->len);
+					if (e->cache->has_strings && dev->strbuf) {
+						*dev->strbuf = e->cache->strings;
+						dev->LanguageID = e->cache->LanguageID;
+					} else if (dev->string_index[0] | dev->string_index[1] | dev->string_index[2]) {
+						dev->strings_pending = 1;
+					}
+					desc_cache_hits++;
+					dev->enum_state = 13;
+					break;
+				}
+				// device changed, forget the old descriptors
+				e->cache->config_len = 0;
+				e->cache = NULL;
+				dev->enum_state = 19;
+				break;
+			}
+			if (e->len > sizeof(e->buf)) {
+				// read the first part now, claim_drivers reads the rest
+				e->len = sizeof(e->buf);
 			}
-			mk_setup(enumsetup, 0x80, 6, 0x0200, 0, enumlen); // 6=GET_DESCRIPTOR
-			queue_Control_Transfer(dev, &enumsetup, enumbuf, NULL);
+			mk_setup(e->setup, 0x80, 6, 0x0200 | dev->config_index, 0, e->len); // 6=GET_DESCRIPTOR
+			queue_Control_Transfer(dev, &e->setup, e->buf, NULL);
 			dev->enum_state = 13;
 			return;
 		case 13: // read all config desc, send set config
-			print_config_descriptor(enumbuf, sizeof(enumbuf));
-			dev->bmAttributes = enumbuf[7];
-			dev->bMaxPower = enumbuf[8];
+			enum_timing(dev, enum_timing_t::CONFIG_DESC);
+			print_config_descriptor(e->buf, sizeof(e->buf));
+			if (e->cache) {
+				use_cached_descriptors(e->cache);
+				e->cache = NULL;
+			} else {
+				desc_cache_misses++;
+				save_cached_descriptors(dev);
+			}
+			dev->bmAttributes = e->buf[7];
+			dev->bMaxPower = e->buf[8];
+			if (!power_available(dev)) {
+				// leave it unconfigured, rather than overload the port
+				println("Not enough power for device, ", dev->bMaxPower * 2);
+				dev->enum_state = 15;
+				free_enum_buffer(dev);
+				USBHost::enumeration_busy = (address0_dev != NULL);
+				return;
+			}
+			dev->bConfigurationValue = e->buf[5];
 			// TODO: actually do something with interface descriptor?
-			mk_setup(enumsetup, 0, 9, enumbuf[5], 0, 0); // 9=SET_CONFIGURATION
-			queue_Control_Transfer(dev, &enumsetup, NULL, NULL);
+			mk_setup(e->setup, 0, 9, e->buf[5], 0, 0); // 9=SET_CONFIGURATION
+			queue_Control_Transfer(dev, &e->setup, NULL, NULL);
 			dev->enum_state = 14;
 			return;
 		case 14: // device is now configured
-			claim_drivers(dev);
+		case 20: // read more config desc
+			enum_timing(dev, enum_timing_t::SET_CONFIG);
+			if (claim_drivers(dev)) return; // reading more config desc
+			dev->enum_state = 15;
+			enum_timing(dev, enum_timing_t::CLAIMED);
+			// give the enumeration buffer back.  If any more devices
+			// are waiting, the hub driver is responsible for resetting
+			// their ports and starting their enumeration when the
+			// port enables.
+			free_enum_buffer(dev);
+			USBHost::enumeration_busy = (address0_dev != NULL);
+			hotplug(dev, hotplug_event_t::ATTACH);
+			// strings skipped during enumeration may be read now
+			if (dev->strings_pending == 1 && string_mode == STRINGS_AFTER_CLAIM) {
+				dev->strings_pending = 2;
+			}
+			if (dev->strings_pending == 2 && stringdev == NULL) {
+				begin_strings(dev);
+			}
+			return;
+		case 16: // finished reading strings after enumeration
 			dev->enum_state = 15;
-			// unlock exclusive access to enumeration process.  If any
-			// more devices are waiting, the hub driver is responsible
-			// for resetting their ports and starting their enumeration
-			// when the port enables.
-			USBHost::enumeration_busy = false;
+			stringdev = NULL;
+			// give the string buffer to the next waiting device
+			for (Device_t *p = devlist; p; p = p->next) {
+				if (p->strings_pending == 2 && p->enum_state == 15) {
+					begin_strings(p);
+					break;
+				}
+			}
 			return;
 		case 15: // control transfers for other stuff?
 			// TODO: handle other standard control: set/clear feature, etc
@@ -294,6 +491,224 @@ void USBHost::enumeration(const Transfer_t *transfer)
 	}
 }
 
+// Find cached descriptors for a device.  If the device has a serial
+// number, serial is its string descriptor, or NULL to find any entry
+// which might match (its LanguageID is used to read the serial number).
+//
+static descriptor_cache_t * find_cached_descriptors(const Device_t *dev, const uint8_t *serial)
+{
+	for (descriptor_cache_t *p = desc_cache; p; p = p->next) {
+		if (p->config_len == 0) continue;
+		if (p->idVendor != dev->idVendor || p->idProduct != dev->idProduct
+		  || p->bcdDevice != dev->bcdDevice
+		  || p->bDeviceClass != dev->bDeviceClass
+		  || p->bDeviceSubClass != dev->bDeviceSubClass
+		  || p->bDeviceProtocol != dev->bDeviceProtocol) continue;
+		if (dev->string_index[2] == 0) return p;
+		if (!p->has_strings) continue;
+		if (serial == NULL) return p;
+		// compare UTF-16 descriptor to the ASCII string saved
+		if (serial[1] != 3) return NULL;
+		const uint8_t *str = &p->strings.buffer[p->strings.iStrings[strbuf_t::STR_ID_SERIAL]];
+		uint32_t i = 2;
+		while (i + 1 < serial[0] && *str && serial[i] == *str) {
+			i += 2;
+			str++;
+		}
+		if (i + 1 >= serial[0] && *str == 0) return p;
+	}
+	return NULL;
+}
+
+// Move a cache entry to the front of the list, most recently used
+//
+static void use_cached_descriptors(descriptor_cache_t *entry)
+{
+	if (entry == desc_cache) return;
+	for (descriptor_cache_t *p = desc_cache; p; p = p->next) {
+		if (p->next == entry) {
+			p->next = entry->next;
+			entry->next = desc_cache;
+			desc_cache = entry;
+			return;
+		}
+	}
+}
+
+// Save a newly enumerated device's descriptors in the least
+// recently used cache entry.
+//
+static void save_cached_descriptors(const Device_t *dev)
+{
+	const enum_buffer_t *e = dev->enumbuf;
+	descriptor_cache_t *entry = desc_cache;
+	if (!entry) return;
+	uint32_t total = e->buf[2] | (e->buf[3] << 8);
+	if (total != e->len || e->len > entry->config_max) return;
+	bool has_strings = (dev->strbuf != NULL && dev->strings_pending == 0);
+	if (dev->string_index[2] && !has_strings) return;
+	while (entry->next) entry = entry->next;
+	entry->idVendor = dev->idVendor;
+	entry->idProduct = dev->idProduct;
+	entry->bcdDevice = dev->bcdDevice;
+	entry->LanguageID = dev->LanguageID;
+	entry->bDeviceClass = dev->bDeviceClass;
+	entry->bDeviceSubClass = dev->bDeviceSubClass;
+	entry->bDeviceProtocol = dev->bDeviceProtocol;
+	entry->has_strings = has_strings;
+	if (has_strings) entry->strings = *dev->strbuf;
+	memcpy(entry->config, e->buf, e->len);
+	entry->config_len = e->len;
+	use_cached_descriptors(entry);
+}
+
+void USBHost::contribute_Descriptor_Cache(descriptor_cache_t *entries, uint32_t num)
+{
+	for (uint32_t i=0; i < num; i++) {
+		entries[i].config_len = 0;
+		entries[i].next = desc_cache;
+		desc_cache = &entries[i];
+	}
+}
+
+// Add an attach or detach event to the queue.  If the queue is full,
+// the event is dropped and counted in the next event added.
+//
+void USBHost::hotplug(Device_t *dev, uint8_t type)
+{
+	uint32_t head = hotplug_head + 1;
+	if (head >= HOTPLUG_QUEUE_SIZE) head = 0;
+	if (head == hotplug_tail) {
+		if (hotplug_lost < 255) hotplug_lost++;
+		return;
+	}
+	hotplug_event_t *event = &hotplug_queue[head];
+	event->type = type;
+	event->speed = dev->speed;
+	event->address = dev->address;
+	event->lost = hotplug_lost;
+	hotplug_lost = 0;
+	// walk up through the hubs, to find the ports leading to this device
+	uint8_t ports[sizeof(event->path)];
+	uint32_t depth = 0;
+	for (const Device_t *d = dev; d && d->hub_address && depth < sizeof(ports); ) {
+		ports[depth++] = d->hub_port;
+		const Device_t *hub = devlist;
+		while (hub && hub->address != d->hub_address) hub = hub->next;
+		d = hub;
+	}
+	event->depth = depth;
+	for (uint32_t i=0; i < depth; i++) {
+		event->path[i] = ports[depth - 1 - i];
+	}
+	event->bDeviceClass = dev->bDeviceClass;
+	event->bDeviceSubClass = dev->bDeviceSubClass;
+	event->bDeviceProtocol = dev->bDeviceProtocol;
+	event->idVendor = dev->idVendor;
+	event->idProduct = dev->idProduct;
+	event->driver = dev->drivers;
+	hotplug_head = head;
+}
+
+bool USBHost::getHotplugEvent(hotplug_event_t &event)
+{
+	__disable_irq();
+	uint32_t tail = hotplug_tail;
+	if (tail == hotplug_head) {
+		__enable_irq();
+		return false;
+	}
+	if (++tail >= HOTPLUG_QUEUE_SIZE) tail = 0;
+	event = hotplug_queue[tail];
+	hotplug_tail = tail;
+	__enable_irq();
+	return true;
+}
+
+// Give a device's enumeration buffer back, when it is configured or
+// disconnects before finishing.
+//
+static void free_enum_buffer(Device_t *dev)
+{
+	enum_buffer_t *e = dev->enumbuf;
+	if (e) {
+		e->next = free_enum_buffers;
+		free_enum_buffers = e;
+		dev->enumbuf = NULL;
+	}
+	if (dev == address0_dev) address0_dev = NULL;
+}
+
+// Give up on a device which can not be enumerated.  Address zero and
+// the enumeration buffer are freed so other devices may enumerate, and
+// the device's port is disabled, so it no longer answers at address
+// zero.  It stays on the device list until it is disconnected.
+//
+void USBHost::enumeration_failed(Device_t *dev)
+{
+	static setup_t disable_setup;
+
+	dev->enum_state = 15;
+	free_enum_buffer(dev);
+	enumeration_busy = (address0_dev != NULL || free_enum_buffers == NULL);
+	if (dev->hub_address == 0) {
+		disable_root_port();
+		return;
+	}
+	for (Device_t *hub = devlist; hub; hub = hub->next) {
+		if (hub->address == dev->hub_address) {
+			mk_setup(disable_setup, 0x23, 1, 1, dev->hub_port, 0); // 1=PORT_ENABLE
+			queue_Control_Transfer(hub, &disable_setup, NULL, NULL);
+			return;
+		}
+	}
+}
+
+void USBHost::contribute_Enumeration_Buffers(enum_buffer_t *bufs, uint32_t num)
+{
+	for (uint32_t i=0; i < num; i++) {
+		bufs[i].next = free_enum_buffers;
+		free_enum_buffers = &bufs[i];
+	}
+}
+
+void USBHost::descriptorCacheStats(uint32_t &hits, uint32_t &misses)
+{
+	hits = desc_cache_hits;
+	misses = desc_cache_misses;
+}
+
+// Start reading string descriptors for a configured device, using
+// the states 3 to 10 of enumeration with stringbuf.
+//
+void USBHost::begin_strings(Device_t *dev)
+{
+	println("begin_strings ", (uint32_t)dev, HEX);
+	stringdev = dev;
+	dev->strings_pending = 0;
+	mk_setup(stringsetup, 0x80, 6, 0x0300, 0, sizeof(stringbuf)); // 6=GET_DESCRIPTOR
+	queue_Control_Transfer(dev, &stringsetup, stringbuf, NULL);
+	dev->enum_state = 4;
+}
+
+// Request string descriptors which were not read during enumeration.
+// Drivers call this from manufacturer(), product() and serialNumber().
+// If another device is already reading its strings, this device's
+// strings are read when it finishes.
+//
+void USBHost::request_strings(Device_t *dev)
+{
+	if (dev == NULL || dev->strings_pending != 1) return;
+	__disable_irq();
+	if (dev->strings_pending == 1) {
+		dev->strings_pending = 2;
+		if (stringdev == NULL && dev->enum_state == 15) {
+			begin_strings(dev);
+		}
+	}
+	__enable_irq();
+}
+
 void  USBHost::convertStringDescriptorToASCIIString(uint8_t string_index, Device_t *dev, const Transfer_t *transfer) {
 	strbuf_t *strbuf = dev->strbuf; 
 	if (!strbuf) return;	// don't have a buffer
@@ -324,32 +739,158 @@ void  USBHost::convertStringDescriptorToASCIIString(uint8_t string_index, Device
 }
 
 
-void USBHost::claim_drivers(Device_t *dev)
+// Add up how much the available drivers prefer a configuration.  This
+// is used only for devices with more than one configuration.
+//
+uint32_t USBHost::rate_configuration(Device_t *dev, const uint8_t *config, uint32_t len)
+{
+	uint32_t preference = 0;
+
+	for (USBDriver *driver=available_drivers; driver != NULL; driver = driver->next) {
+		if (driver->device != NULL) continue;
+		preference += driver->config_preference(dev, config, len);
+	}
+	return preference;
+}
+
+// Check a driver's match lists, to learn if it might claim this device,
+// interface or IAD.  Drivers without any lists might claim anything.
+//
+bool USBHost::driver_matches(const USBDriver *driver, const Device_t *dev,
+	int type, const uint8_t *p)
+{
+	if (driver->match_list == NULL && driver->id_list == NULL) return true;
+	uint8_t typebit = 1 << type;
+	if (driver->id_types & typebit) {
+		const uint8_t *id = driver->id_list;
+		for (uint32_t i=0; i < driver->id_count; i++) {
+			uint16_t vid = id[0] | (id[1] << 8);
+			uint16_t pid = id[2] | (id[3] << 8);
+			if (vid == dev->idVendor && pid == dev->idProduct) return true;
+			id += driver->id_stride;
+		}
+	}
+	uint8_t cls, subclass, protocol;
+	if (type == 0) {
+		cls = dev->bDeviceClass;
+		subclass = dev->bDeviceSubClass;
+		protocol = dev->bDeviceProtocol;
+	} else if (type == 1) {
+		cls = p[5];
+		subclass = p[6];
+		protocol = p[7];
+	} else {
+		cls = p[4];
+		subclass = p[5];
+		protocol = p[6];
+	}
+	for (uint32_t i=0; i < driver->match_count; i++) {
+		const driver_match_t *m = driver->match_list + i;
+		if (!(m->types & typebit)) continue;
+		if ((m->match & driver_match_t::VENDOR) && m->idVendor != dev->idVendor) continue;
+		if ((m->match & driver_match_t::PRODUCT) && m->idProduct != dev->idProduct) continue;
+		if ((m->match & driver_match_t::CLASS) && m->bClass != cls) continue;
+		if ((m->match & driver_match_t::SUBCLASS) && m->bSubClass != subclass) continue;
+		if ((m->match & driver_match_t::PROTOCOL) && m->bProtocol != protocol) continue;
+		return true;
+	}
+	return false;
+}
+
+// Offer a device (type 0), interface (type 1) or IAD function (type 2)
+// to the available drivers.  Returns true if a driver claimed it.
+//
+bool USBHost::offer_to_drivers(Device_t *dev, int type, const uint8_t *p, uint32_t len)
 {
 	USBDriver *driver, *prev=NULL;
 
-	// first check if any driver wishes to claim the entire device
 	for (driver=available_drivers; driver != NULL; driver = driver->next) {
 		if (driver->device != NULL) continue;
-		if (driver->claim(dev, 0, enumbuf + 9, enumlen - 9)) {
+		if (!driver_matches(driver, dev, type, p)) {
+			prev = driver;
+			continue;
+		}
+		if (driver->claim(dev, type, p, len)) {
+			// remove it from available_drivers list
 			if (prev) {
 				prev->next = driver->next;
 			} else {
 				available_drivers = driver->next;
 			}
-			driver->device = dev;
-			driver->next = NULL;
+			// add to list of drivers using this device
+			driver->next = dev->drivers;
 			dev->drivers = driver;
-			return;
+			driver->device = dev;
+			return true;
 		}
 		prev = driver;
 	}
+	return false;
+}
+
+// Find the end of the descriptors which belong to an interface (with
+// its alternate settings) or to all the interfaces of an IAD.  The
+// group ends at the next IAD or other interface.  If the group reaches
+// the end of the data, it may continue in more config data.
+//
+static const uint8_t * find_group_end(const uint8_t *p, const uint8_t *end)
+{
+	uint32_t first = p[2];
+	uint32_t count = (p[1] == 11) ? p[3] : 1; // IAD: bInterfaceCount
+	p += p[0];
+	while (p + 2 <= end) {
+		if (p[0] < 2 || p + p[0] > end) return end;
+		if (p[1] == 11) return p;
+		if (p[1] == 4 && (p[2] < first || p[2] >= first + count)) return p;
+		p += p[0];
+	}
+	return end;
+}
+
+// Remember which interfaces were claimed, so their alternate settings
+// are not offered again from a later window.
+//
+static bool interface_claimed(const enum_buffer_t *e, uint32_t num)
+{
+	return e->claimed[num >> 5] & (1 << (num & 31));
+}
+
+static void set_interfaces_claimed(enum_buffer_t *e, uint32_t first, uint32_t count)
+{
+	for (uint32_t num = first; num < first + count && num < 256; num++) {
+		e->claimed[num >> 5] |= (1 << (num & 31));
+	}
+}
+
+// Offer the device and its interfaces to the available drivers.  When
+// the config descriptor is larger than the enumeration buffer, this is called again
+// for each window of it.  Returns true if another window was requested,
+// and claim_drivers will be called again when it arrives.
+//
+// An interface or IAD is offered only when all its descriptors are in
+// the window.  If they might continue past its end, the next window
+// begins at the interface instead.  An interface too large for any
+// window is skipped, and an IAD too large is not offered as a whole,
+// so its interfaces are offered one at a time.
+//
+bool USBHost::claim_drivers(Device_t *dev)
+{
+	enum_buffer_t *e = dev->enumbuf;
+
+	// first check if any driver wishes to claim the entire device
+	if (e->offset == 0 && e->parse == 9) {
+		memset(e->claimed, 0, sizeof(e->claimed));
+		if (offer_to_drivers(dev, 0, e->buf + 9, e->len - 9)) return false;
+	}
 	// parse interfaces from config descriptor
-	const uint8_t *p = enumbuf + 9;
-	const uint8_t *end = enumbuf + enumlen;
-	while (p < end) {
+	const uint8_t *p = e->buf + (e->parse - e->offset);
+	const uint8_t *end = e->buf + e->len;
+	bool more = (e->offset + e->len < e->total);
+	while (p + 2 <= end) {
 		uint8_t desclen = *p;
 		uint8_t desctype = *(p+1);
+		if (desclen < 2) break; // corrupt descriptor
+		if (p + desclen > end) break; // continues in next window
 		print("Descriptor ");
 		print(desctype);
 		print(" = ");
@@ -360,69 +901,181 @@ void USBHost::claim_drivers(Device_t *dev)
 		else if (desctype == 11) println("IAD");
 		else if (desctype == 33) println("HID");
 		else println(" ???");
-		if (desctype == 11 && desclen == 8) {
-			// TODO: parse IAD, ask drivers for claim
-			// TODO: how to skip over all interfaces IAD represented
-		}
-		if (desctype == 4 && desclen == 9) {
-			// found an interface, ask available drivers if they want it
-			prev = NULL;
-			for (driver=available_drivers; driver != NULL; driver = driver->next) {
-				if (driver->device != NULL) continue;
-				// TODO: should parse ahead and give claim()
-				// an accurate length.  (end - p) is the rest
-				// of ALL descriptors, likely more interfaces
-				// this driver has no business parsing
-				if (driver->claim(dev, 1, p, end - p)) {
-					// this driver claims iface
-					// remove it from available_drivers list
-					if (prev) {
-						prev->next = driver->next;
-					} else {
-						available_drivers = driver->next;
-					}
-					// add to list of drivers using this device
-					driver->next = dev->drivers;
-					dev->drivers = driver;
-					driver->device = dev;
-					// not done, may be more interface for more drivers
+		const uint8_t *next = p + desclen;
+		if (((desctype == 11 && desclen == 8) || (desctype == 4 && desclen == 9))
+		  && !interface_claimed(e, p[2])) {
+			const uint8_t *group_end = find_group_end(p, end);
+			uint32_t offset = e->offset + (p - e->buf);
+			if (group_end == end && more) {
+				// this group's descriptors might continue past
+				// the end of the buffer, so read a window starting here
+				if ((offset & ~127) > e->offset) {
+					e->parse = offset;
+					break;
 				}
-				prev = driver;
+				// it already begins in this window's first 128
+				// bytes, so it can never fit in one window
+				print("Descriptors too large to offer, ");
+				println((desctype == 11) ? "IAD at interface " : "interface ", p[2]);
+				if (desctype == 4) set_interfaces_claimed(e, p[2], 1);
+			} else if (offer_to_drivers(dev, (desctype == 11) ? 2 : 1, p, group_end - p)) {
+				// ask available drivers if they want the whole IAD
+				// function (type 2) or this interface (type 1).  If
+				// claimed, skip the rest of its descriptors.  If an
+				// IAD isn't claimed, its interfaces are offered one
+				// at a time.
+				set_interfaces_claimed(e, p[2], (desctype == 11) ? p[3] : 1);
+				next = group_end;
 			}
 		}
-		p += desclen;
+		p = next;
+		e->parse = e->offset + (p - e->buf);
+	}
+	if (!more) return false;
+	// read the next window of the config descriptor, beginning at
+	// a 128 byte boundary at or before the next unparsed descriptor
+	uint32_t total = e->total;
+	uint32_t offset = e->parse & ~127;
+	if (offset <= e->offset) return false; // corrupt descriptor, no progress
+	if (total > offset + sizeof(e->buf)) total = offset + sizeof(e->buf);
+	println("Config data window at ", offset);
+	mk_setup(e->setup, 0x80, 6, 0x0200 | dev->config_index, 0, total); // 6=GET_DESCRIPTOR
+	if (!queue_Control_Window(dev, &e->setup, e->buf, offset, NULL)) {
+		println("  unable to read more config data");
+		return false;
 	}
+	e->offset = offset;
+	e->len = total - offset;
+	dev->enum_state = 20;
+	return true;
 }
 
-static bool address_in_use(uint32_t addr)
+// Find a device by its address
+//
+static Device_t * find_device(uint32_t addr)
 {
+	if (addr == 0) return NULL;
 	for (Device_t *p = devlist; p; p = p->next) {
-		if (p->address == addr) return true;
+		if (p->address == addr) return p;
+	}
+	return NULL;
+}
+
+// Current a device takes from its upstream port, in mA.  Bus powered
+// hubs pass their ports' current through.  Only configured devices
+// count, plus the one about to be configured.
+//
+static uint32_t upstream_current(const Device_t *dev, const Device_t *configuring)
+{
+	if (dev != configuring && (dev->enumbuf != NULL || dev->bConfigurationValue == 0)) {
+		return 0;
+	}
+	uint32_t mA = dev->bMaxPower * 2;
+	if (dev->bDeviceClass == 9 && !(dev->bmAttributes & 0x40) && dev->address != 0) {
+		for (const Device_t *p = devlist; p; p = p->next) {
+			if (p->hub_address == dev->address) mA += upstream_current(p, configuring);
+		}
+	}
+	return mA;
+}
+
+// Check whether configuring a device would take more current than its
+// port may supply.  Bus powered hub ports supply 100 mA each, and at
+// most 500 mA for the hub and all its ports.  Self powered hub ports
+// supply 500 mA.  The host port supplies power_budget.
+//
+bool USBHost::power_available(const Device_t *dev)
+{
+	const Device_t *d = dev;
+	while (1) {
+		uint32_t mA = upstream_current(d, dev);
+		if (d != dev && mA > 500) return false; // bus powered hub total
+		const Device_t *hub = find_device(d->hub_address);
+		if (hub == NULL) return mA <= power_budget;
+		if (hub->bmAttributes & 0x40) return mA <= 500;
+		if (mA > 100) return false;
+		d = hub;
 	}
-	return false;
 }
 
+// Add a device and everything connected to it, if it is a hub, to
+// a topology list.  Returns the new number of devices found.
+//
+static uint32_t add_topology(uint32_t hub_address, uint32_t depth,
+	device_topology_t *list, uint32_t max, uint32_t count)
+{
+	for (const Device_t *p = devlist; p; p = p->next) {
+		if (p->hub_address != hub_address) continue;
+		if (count < max) {
+			device_topology_t *t = list + count;
+			t->address = p->address;
+			t->hub_address = p->hub_address;
+			t->hub_port = p->hub_port;
+			t->depth = depth;
+			t->speed = p->speed;
+			t->configured = (p->enumbuf == NULL && p->bConfigurationValue != 0);
+			t->self_powered = (p->bmAttributes & 0x40) ? 1 : 0;
+			t->bDeviceClass = p->bDeviceClass;
+			t->idVendor = p->idVendor;
+			t->idProduct = p->idProduct;
+			t->power_mA = p->bMaxPower * 2;
+			t->upstream_mA = upstream_current(p, NULL);
+		}
+		count++;
+		if (p->bDeviceClass == 9 && p->address != 0) {
+			count = add_topology(p->address, depth + 1, list, max, count);
+		}
+	}
+	return count;
+}
+
+// Fill in a list of all devices, starting with the one on the host
+// port, each followed by the devices connected to it if it is a hub.
+// Returns the number of devices, which may be more than max.
+//
+uint32_t USBHost::getTopology(device_topology_t *list, uint32_t max)
+{
+	__disable_irq();
+	uint32_t count = add_topology(0, 0, list, max, 0);
+	__enable_irq();
+	return count;
+}
+
+// Find the next unused address after the last one assigned, so a
+// recently disconnected device's address is not soon reused.  Returns
+// 0 if all 127 addresses are in use.
+//
 uint32_t USBHost::assign_address(void)
 {
 	static uint8_t last_assigned_address=0;
-	uint32_t addr = last_assigned_address;
-	while (1) {
-		if (++addr > 127) addr = 1;
-		if (!address_in_use(addr)) {
+	uint32_t addr = last_assigned_address + 1;
+	for (uint32_t n=0; n < 5; n++) {
+		uint32_t i = (addr >> 5) & 3;
+		uint32_t free = ~address_bitmap[i] & (0xFFFFFFFF << (addr & 31));
+		if (free) {
+			addr = (i << 5) + __builtin_ctz(free);
+			address_bitmap[i] |= 1u << (addr & 31);
 			last_assigned_address = addr;
 			return addr;
 		}
+		addr = ((i + 1) & 3) << 5; // beginning of next word
 	}
+	return 0;
+}
+
+static void free_address(uint32_t addr)
+{
+	if (addr > 0 && addr < 128) address_bitmap[addr >> 5] &= ~(1u << (addr & 31));
 }
 
 static void pipe_set_maxlen(Pipe_t *pipe, uint32_t maxlen)
 {
-	pipe->qh.capabilities[0] = (pipe->qh.capabilities[0] & 0xF800FFFF) | (maxlen << 16);
+	pipe->qh->capabilities[0] = (pipe->qh->capabilities[0] & 0xF800FFFF) | (maxlen << 16);
 }
 
 static void pipe_set_addr(Pipe_t *pipe, uint32_t addr)
 {
-	pipe->qh.capabilities[0] = (pipe->qh.capabilities[0] & 0xFFFFFF80) | addr;
+	pipe->qh->capabilities[0] = (pipe->qh->capabilities[0] & 0xFFFFFF80) | addr;
 }
 
 
@@ -430,6 +1083,10 @@ void USBHost::disconnect_Device(Device_t *dev)
 {
 	if (!dev) return;
 	println("disconnect_Device:");
+	// only devices which finished enumeration were reported attached
+	if (dev->enumbuf == NULL && dev->bConfigurationValue != 0) {
+		hotplug(dev, hotplug_event_t::DETACH);
+	}
 
 	// Disconnect all drivers using this device.  If this device is
 	// a hub, the hub driver is responsible for recursively calling
@@ -447,6 +1104,13 @@ void USBHost::disconnect_Device(Device_t *dev)
 	}
 	print_driverlist("available_drivers", available_drivers);
 
+	// a device disconnecting during SET_ADDRESS already has an address
+	if (dev->address) {
+		free_address(dev->address);
+	} else if (dev->enumbuf && dev->enum_state == 1) {
+		free_address(dev->enumbuf->setup.wValue);
+	}
+
 	// delete all the pipes
 	for (Pipe_t *p = dev->data_pipes; p; ) {
 		Pipe_t *next = p->next;
@@ -468,6 +1132,21 @@ void USBHost::disconnect_Device(Device_t *dev)
 			if (p->strbuf != nullptr ) {
 				free_string_buffer(p->strbuf);
 			}
+			if (p->enumbuf || p == address0_dev) {
+				// disconnected before enumeration finished
+				free_enum_buffer(p);
+				enumeration_busy = (address0_dev != NULL || free_enum_buffers == NULL);
+			}
+			if (p == stringdev) {
+				// give the string buffer to the next waiting device
+				stringdev = NULL;
+				for (Device_t *d = devlist; d; d = d->next) {
+					if (d->strings_pending == 2 && d->enum_state == 15) {
+						begin_strings(d);
+						break;
+					}
+				}
+			}
 			free_Device(p);
 			break;
 		}
@@ -27,7 +27,7 @@ bool HIDDumpController::changed_data_only = false;
 
 void HIDDumpController::init()
 {
-  USBHost::contribute_Transfers(mytransfers, sizeof(mytransfers) / sizeof(Transfer_t));
+  USBHost::contribute_Transfers(mytransfers, myqtds, sizeof(mytransfers) / sizeof(Transfer_t));
   USBHIDParser::driver_ready_for_hid_collection(this);
 }
 
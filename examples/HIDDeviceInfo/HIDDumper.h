@@ -34,6 +34,7 @@ private:
   int index_usages_ = 0;
   
   // See if we can contribute transfers
-  Transfer_t mytransfers[2] __attribute__ ((aligned(32)));
+  Transfer_t mytransfers[2];
+  qTD_t myqtds[2] __attribute__ ((aligned(32)));
 };
 #endif // __HIDDumper_h_
@@ -35,14 +35,129 @@
 #define print   USBHost::print_
 #define println USBHost::println_
 
+// Any HID interface, bInterfaceClass 3
+static const driver_match_t hid_match[] = {
+	{driver_match_t::INTERFACE, driver_match_t::CLASS, 0, 0, 3, 0, 0}
+};
+
+// Report descriptor memory.  Each free block begins with this header,
+// and the free list is kept in address order so neighbouring blocks
+// join again when freed.  A block in use holds only descriptor, field
+// table or transmit bytes, and its owner remembers the block size to
+// give it back.  Block sizes are a multiple of 8 bytes.
+typedef struct descbuf_struct {
+	struct descbuf_struct *next;
+	uint32_t size;
+} descbuf_t;
+
+static descbuf_t *free_descbufs = NULL;
+static uint32_t shared_descbuf[256];
+static bool shared_descbuf_contributed = false;
+
 void USBHIDParser::init()
 {
-	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	contribute_Pipes(mypipes, myqhs, sizeof(mypipes)/sizeof(Pipe_t));
+	contribute_Transfers(mytransfers, myqtds, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+	contribute_Descriptor_Buffer(mydescbuf, sizeof(mydescbuf));
+#endif
+	if (!shared_descbuf_contributed) {
+		contribute_Descriptor_Buffer(shared_descbuf, sizeof(shared_descbuf));
+		shared_descbuf_contributed = true;
+	}
+	match_table(hid_match, sizeof(hid_match)/sizeof(driver_match_t));
 	driver_ready_for_device(this);
 }
 
+void USBHIDParser::contribute_Descriptor_Buffer(void *buffer, uint32_t size)
+{
+	size &= ~7;
+	if (size < sizeof(descbuf_t)) return;
+	free_Descriptor_Buffer((uint8_t *)buffer, size);
+}
+
+// Take len bytes from the smallest free block which holds them.  The
+// rest of the block stays free, unless too small for the header.
+uint8_t * USBHIDParser::allocate_Descriptor_Buffer(uint32_t len, uint32_t *size)
+{
+	len = (len + 7) & ~7;
+	if (len < sizeof(descbuf_t)) len = sizeof(descbuf_t);
+	__disable_irq();
+	descbuf_t **best = NULL;
+	for (descbuf_t **d = &free_descbufs; *d; d = &((*d)->next)) {
+		if ((*d)->size >= len && (best == NULL || (*d)->size < (*best)->size)) {
+			best = d;
+		}
+	}
+	descbuf_t *block = NULL;
+	if (best) {
+		block = *best;
+		if (block->size - len >= sizeof(descbuf_t)) {
+			descbuf_t *rest = (descbuf_t *)((uint8_t *)block + len);
+			rest->next = block->next;
+			rest->size = block->size - len;
+			*best = rest;
+			*size = len;
+		} else {
+			*best = block->next;
+			*size = block->size;
+		}
+	}
+	__enable_irq();
+	return (uint8_t *)block;
+}
+
+void USBHIDParser::free_Descriptor_Buffer(uint8_t *buffer, uint32_t size)
+{
+	descbuf_t *block = (descbuf_t *)buffer;
+	descbuf_t *prev = NULL;
+	__disable_irq();
+	descbuf_t **d = &free_descbufs;
+	while (*d && *d < block) {
+		prev = *d;
+		d = &((*d)->next);
+	}
+	block->size = size;
+	block->next = *d;
+	*d = block;
+	// join with the following free block, then the one before
+	if (block->next && (uint8_t *)block + block->size == (uint8_t *)block->next) {
+		block->size += block->next->size;
+		block->next = block->next->next;
+	}
+	if (prev && (uint8_t *)prev + prev->size == (uint8_t *)block) {
+		prev->size += block->size;
+		prev->next = block->next;
+	}
+	__enable_irq();
+}
+
+// Give back the report descriptor memory.  Once compiled, the field
+// tables hold everything needed to decode reports.
+void USBHIDParser::release_descriptor()
+{
+	if (descriptor) {
+		free_Descriptor_Buffer(descriptor, descbuf_size);
+		descriptor = nullptr;
+	}
+}
+
+// Give back the compiled field tables.
+void USBHIDParser::release_table()
+{
+	compiled = false;
+	if (table) {
+		free_Descriptor_Buffer(table, table_size);
+		table = nullptr;
+	}
+	fields = nullptr;
+	report_fields = nullptr;
+	field_usages = nullptr;
+	report_buffer = nullptr;
+	report_history = nullptr;
+}
+
 bool USBHIDParser::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len)
 {
 	println("HIDParser claim this=", (uint32_t)this, HEX);
@@ -83,7 +198,6 @@ bool USBHIDParser::claim(Device_t *dev, int type, const uint8_t *descriptors, ui
 		i++;
 		if (i >= descriptors[14]) return false;
 	}
-	if (descsize > sizeof(descriptor)) return false; // can't fit the report descriptor
 
 	// endpoint descriptor(s)
 	uint32_t offset = 9 + hidlen;
@@ -144,21 +258,39 @@ bool USBHIDParser::claim(Device_t *dev, int type, const uint8_t *descriptors, ui
 		out_pipe->callback_function = out_callback;
 	}
 	in_pipe->callback_function = in_callback;
+	compiled = false;
+	unknown_report_ids = 0;
 	for (uint32_t i=0; i < TOPUSAGE_LIST_LEN; i++) {
 		//topusage_list[i] = 0;
 		topusage_drivers[i] = NULL;
 	}
 	// request the HID report descriptor
+	descriptor = allocate_Descriptor_Buffer(descsize, &descbuf_size);
+	if (!descriptor) {
+		println("no memory for report descriptor, size = ", descsize);
+		return false;
+	}
 	bInterfaceNumber = descriptors[2];	// save away the interface number; 
 	mk_setup(setup, 0x81, 6, 0x2200, descriptors[2], descsize); // get report desc
-	queue_Control_Transfer(dev, &setup, descriptor, this);
+	queue_setup(dev, descriptor);
 	return true;
 }
 
+// Queue a control transfer of setup.  The controller reads setup and
+// the data buffer by DMA, so only one may be in flight at a time.
+bool USBHIDParser::queue_setup(Device_t *dev, void *buf)
+{
+	setup_busy = true;
+	if (queue_Control_Transfer(dev, &setup, buf, this)) return true;
+	setup_busy = false;
+	return false;
+}
+
 void USBHIDParser::control(const Transfer_t *transfer)
 {
 	println("control callback (hid)");
 	print_hexbytes(transfer->buffer, transfer->length);
+	setup_busy = false;	// every control transfer here uses setup
 	if (topusage_drivers[0]) {
 		if (topusage_drivers[0]->hid_process_control(transfer)) {
 			return; // the called function can tell us they processed it.
@@ -172,14 +304,22 @@ void USBHIDParser::control(const Transfer_t *transfer)
 	if (mesg == 0x22000681 && transfer->length == descsize) { // HID report descriptor
 		println("  got report descriptor");
 		parse();
-		queue_Data_Transfer(in_pipe, report, in_size, this);
-		queue_Data_Transfer(in_pipe, report2, in_size, this);
+		compile();
+		if (compiled) release_descriptor();
+		// keep all but one report buffer queued, the last is the spare
+		reports_queued = 0;
+		for (uint32_t i=0; i < USBHOST_HID_REPORT_BUFFERS - 1; i++) {
+			if (queue_Data_Transfer(in_pipe, reports[i], in_size, this)) {
+				reports_queued++;
+			}
+		}
+		report_spare = USBHOST_HID_REPORT_BUFFERS - 1;
 		if (device->idVendor == 0x054C && 
 				((device->idProduct == 0x0268) || (device->idProduct == 0x042F)/* || (device->idProduct == 0x03D5)*/)) {
 			println("send special PS3 feature command");
 			mk_setup(setup, 0x21, 9, 0x03F4, 0, 4); // ps3 tell to send report 1?
 			static uint8_t ps3_feature_F4_report[] = {0x42, 0x0c, 0x00, 0x00};
-			queue_Control_Transfer(device, &setup, ps3_feature_F4_report, this);
+			queue_setup(device, ps3_feature_F4_report);
 		}
 	}
 }
@@ -203,6 +343,17 @@ void USBHIDParser::out_callback(const Transfer_t *transfer)
 // for all drivers which claimed a top level collection
 void USBHIDParser::disconnect()
 {
+	setup_busy = false;
+	release_table();
+	release_descriptor();
+	if (txbuf) {
+		if (tx1 == txbuf) {
+			tx1 = NULL;
+			tx2 = NULL;
+		}
+		free_Descriptor_Buffer(txbuf, txbuf_size);
+		txbuf = nullptr;
+	}
 	for (uint32_t i=0; i < TOPUSAGE_LIST_LEN; i++) {
 		USBHIDInput *driver = topusage_drivers[i];
 		if (driver) {
@@ -228,9 +379,23 @@ void USBHIDParser::in_data(const Transfer_t *transfer)
 	print(" - ");
 	print_hexbytes(transfer->buffer, transfer->length);
 	*/
-	const uint8_t *buf = (const uint8_t *)transfer->buffer;
+	uint8_t *buf = (uint8_t *)transfer->buffer;
 	uint32_t len = transfer->length;
 
+	// Give the device the spare buffer before parsing this report,
+	// then this buffer becomes the spare.  If every other buffer had
+	// already been filled, the device may have had to wait.
+	received_reports++;
+	report_timestamp = transfer->timestamp;
+	if (reports_queued > 0) reports_queued--;
+	if (reports_queued == 0) report_overruns++;
+	bool requeue = true;
+	if (queue_Data_Transfer(in_pipe, reports[report_spare], in_size, this)) {
+		reports_queued++;
+		report_spare = (buf - reports[0]) / sizeof(reports[0]);
+		requeue = false;
+	}
+
 	// See if the first top report wishes to bypass the
 	// parse...
 	if (!(topusage_drivers[0] && topusage_drivers[0]->hid_process_in_data(transfer))) {
@@ -243,8 +408,9 @@ void USBHIDParser::in_data(const Transfer_t *transfer)
 			}
 		}
 	}
-	if (buf == report2) queue_Data_Transfer(in_pipe, report2, in_size, this);
-	else queue_Data_Transfer(in_pipe, report, in_size, this);
+	if (requeue && queue_Data_Transfer(in_pipe, buf, in_size, this)) {
+		reports_queued++;
+	}
 }
 
 
@@ -273,11 +439,17 @@ void USBHIDParser::timer_event(USBDriverTimer *whichTimer)
 bool USBHIDParser::sendPacket(const uint8_t *buffer, int cb) {
 	if (!out_size || !out_pipe) return false;	
 	if (!tx1) {
-		// Was not init before, for now lets put it at end of descriptor
-		// TODO: should verify that either don't exceed overlap descsize
-		//       Or that we have taken over this device
-		tx1 = &descriptor[sizeof(descriptor) - out_size];
-		tx2 = tx1 - out_size;
+		// Was not init before, take two buffers from the descriptor
+		// memory, or only one if that's all which is available
+		txbuf = allocate_Descriptor_Buffer(out_size * 2, &txbuf_size);
+		if (txbuf) {
+			tx2 = txbuf + out_size;
+		} else {
+			txbuf = allocate_Descriptor_Buffer(out_size, &txbuf_size);
+			if (!txbuf) return false;
+			tx2 = NULL;
+		}
+		tx1 = txbuf;
 	}
 	if ((txstate & 3) == 3) return false; 	// both transmit buffers are full
 	if (cb == -1)
@@ -311,13 +483,28 @@ bool USBHIDParser::sendControlPacket(uint32_t bmRequestType, uint32_t bRequest,
 {
 	// Use setup structure to build packet 
 	Serial.printf(">>> SendControlPacket: %x %x %x %x %d", bmRequestType, bRequest, wValue, wIndex, wLength);
+	if (setup_busy) return false;
 	mk_setup(setup, bmRequestType, bRequest, wValue, wIndex, wLength); // ps3 tell to send report 1?
-	bool fReturn =  queue_Control_Transfer(device, &setup, buf, this);
+	bool fReturn = queue_setup(device, buf);
 	Serial.printf(" return: %u\n", fReturn);
 	return fReturn;
 }
 
 
+// The global items which Push saves and Pop restores.  report is the
+// Report ID, or an index into report_ids inside compile().
+typedef struct {
+	int32_t  logical_min;
+	int32_t  logical_max;
+	int32_t  physical_min;
+	int32_t  physical_max;
+	uint16_t usage_page;
+	uint16_t report_size;
+	uint16_t report_count;
+	int8_t   unit_exponent;
+	uint8_t  report;
+} hid_globals_t;
+
 // This no-inputs parse is meant to be used when we first get the
 // HID report descriptor.  It finds all the top level collections
 // and allows drivers to claim them.  This is always where we
@@ -330,12 +517,14 @@ void USBHIDParser::parse()
 	uint16_t usage = 0;
 	uint8_t collection_level = 0;
 	uint8_t topusage_count = 0;
+	uint16_t usage_page_stack[PUSH_STACK_LEN];
+	uint8_t push_count = 0;
 
 	use_report_id = false;
 	while (p < end) {
 		uint8_t tag = *p;
 		if (tag == 0xFE) { // Long Item
-			p += *p + 3;
+			p += p[1] + 3;
 			continue;
 		}
 		uint32_t val;
@@ -362,6 +551,12 @@ void USBHIDParser::parse()
 		  case 0x04: // Usage Page (global)
 			usage_page = val;
 			break;
+		  case 0xA4: // Push
+			if (push_count < PUSH_STACK_LEN) usage_page_stack[push_count++] = usage_page;
+			break;
+		  case 0xB4: // Pop
+			if (push_count > 0) usage_page = usage_page_stack[--push_count];
+			break;
 		  case 0x08: // Usage (local)
 			usage = val;
 			break;
@@ -471,9 +666,19 @@ static int32_t signedval(uint32_t num, uint8_t tag)
 	return (int32_t)num;
 }
 
+// HID 1.11 gives the Unit Exponent as a 4 bit signed nibble, but some
+// devices give a signed byte.
+static int8_t unitexponent(uint32_t num, uint8_t tag)
+{
+	if (num <= 0x0F) return (num & 0x08) ? (int32_t)num - 16 : (int32_t)num;
+	return signedval(num, tag);
+}
+
 // parse the report descriptor and use it to feed the fields of the report
-// to the drivers which have claimed its top level collections
-void USBHIDParser::parse(uint16_t type_and_report_id, const uint8_t *data, uint32_t len)
+// to the drivers which have claimed its top level collections.  This is
+// only used when compile() could not fit the descriptor into the field
+// table.
+void USBHIDParser::parse_descriptor(uint16_t type_and_report_id, const uint8_t *data, uint32_t len)
 {
 	const uint8_t *p = descriptor;
 	const uint8_t *end = p + descsize;
@@ -490,7 +695,13 @@ void USBHIDParser::parse(uint16_t type_and_report_id, const uint8_t *data, uint3
 	uint32_t last_usage = 0;
 	int32_t logical_min = 0;
 	int32_t logical_max = 0;
+	int32_t physical_min = 0;
+	int32_t physical_max = 0;
+	int8_t unit_exponent = 0;
 	uint32_t bitindex = 0;
+	hid_globals_t push_stack[PUSH_STACK_LEN];
+	uint8_t push_count = 0;
+	uint8_t delimiter = 0;
 
 	while (p < end) {
 		uint8_t tag = *p;
@@ -534,7 +745,50 @@ void USBHIDParser::parse(uint16_t type_and_report_id, const uint8_t *data, uint3
 		  case 0x84: // Report ID (global)
 			report_id = val;
 			break;
+		  case 0x34: // Physical Minimum (global)
+			physical_min = signedval(val, tag);
+			break;
+		  case 0x44: // Physical Maximum (global)
+			physical_max = signedval(val, tag);
+			break;
+		  case 0x54: // Unit Exponent (global)
+			unit_exponent = unitexponent(val, tag);
+			break;
+		  case 0xA4: // Push
+			if (push_count < PUSH_STACK_LEN) {
+				hid_globals_t *g = &push_stack[push_count++];
+				g->logical_min = logical_min;
+				g->logical_max = logical_max;
+				g->physical_min = physical_min;
+				g->physical_max = physical_max;
+				g->usage_page = usage_page;
+				g->report_size = report_size;
+				g->report_count = report_count;
+				g->unit_exponent = unit_exponent;
+				g->report = report_id;
+			}
+			break;
+		  case 0xB4: // Pop
+			if (push_count > 0) {
+				const hid_globals_t *g = &push_stack[--push_count];
+				logical_min = g->logical_min;
+				logical_max = g->logical_max;
+				physical_min = g->physical_min;
+				physical_max = g->physical_max;
+				usage_page = g->usage_page;
+				report_size = g->report_size;
+				report_count = g->report_count;
+				unit_exponent = g->unit_exponent;
+				report_id = g->report;
+			}
+			break;
+		  case 0xA8: // Delimiter (local)
+			delimiter = val ? 1 : 0;
+			break;
 		  case 0x08: // Usage (local)
+			// only the first usage of a delimited set is used
+			if (delimiter > 1) break;
+			if (delimiter) delimiter = 2;
 			if (usage_count < USAGE_LIST_LEN) {
 				// Usages: 0 is reserved 0x1-0x1f is sort of reserved for top level things like
 				// 0x1 - Pointer - A collection... So lets try ignoring these
@@ -590,6 +844,10 @@ void USBHIDParser::parse(uint16_t type_and_report_id, const uint8_t *data, uint3
 				println("       max=  ", logical_max);
 				println("       reportcount=", report_count);
 				println("       usage count=", usage_count);
+				driver->input_timestamp = report_timestamp;
+				driver->input_physical_min = physical_min;
+				driver->input_physical_max = physical_max;
+				driver->input_unit_exponent = unit_exponent;
 				driver->hid_input_begin(topusage, val, logical_min, logical_max);
 				println("Input, total bits=", report_count * report_size);
 				if ((val & 2)) {
@@ -671,21 +929,15 @@ void USBHIDParser::parse(uint16_t type_and_report_id, const uint8_t *data, uint3
 			reset_local = true;
 			break;
 
-		  case 0x34: // Physical Minimum (global)
-		  case 0x44: // Physical Maximum (global)
-		  case 0x54: // Unit Exponent (global)
 		  case 0x64: // Unit (global)
-			break; // Ignore these commonly used tags.  Hopefully not needed?
-
-		  case 0xA4: // Push (yikes! Hope nobody really uses this?!)
-		  case 0xB4: // Pop (yikes! Hope nobody really uses this?!)
 		  case 0x38: // Designator Index (local)
 		  case 0x48: // Designator Minimum (local)
 		  case 0x58: // Designator Maximum (local)
 		  case 0x78: // String Index (local)
 		  case 0x88: // String Minimum (local)
 		  case 0x98: // String Maximum (local)
-		  case 0xA8: // Delimiter (local)
+			break; // not needed to decode the report data
+
 		  default:
 			println("Ruh Roh, unsupported tag, not a good thing Scoob ", tag, HEX);
 			break;
@@ -698,3 +950,636 @@ void USBHIDParser::parse(uint16_t type_and_report_id, const uint8_t *data, uint3
 	}
 }
 
+// Compile the report descriptor into a table of Input fields, grouped
+// by report ID.  This runs once, after parse() has found the drivers for
+// the top level collections, and follows the same rules as
+// parse_descriptor() so drivers see exactly the same data.  Fields for
+// collections no driver claimed, and constant fields, only move the bit
+// position of the fields after them.  The descriptor is walked twice,
+// first to count the fields, usages and report bytes, then to fill in
+// tables sized for this device.  If they do not fit in descriptor memory,
+// or the descriptor has more report IDs than report_ids holds, compiled
+// stays false.
+void USBHIDParser::compile()
+{
+	const uint8_t *end = descriptor + descsize;
+	uint32_t report_bits[REPORT_BUFFER_LIST_LEN];
+	uint32_t input_bits[REPORT_LIST_LEN];	// end of each report's Input fields
+	uint16_t history_any;			// reports with fields to compare
+	uint16_t history_partial;		// reports with fields not compared
+	hid_field_t unused_field;		// fields of the counting pass
+	uint32_t rb;
+
+	release_table();
+	// Reports with fields for drivers wanting only changes keep a copy
+	// of the previous report, to compare with the next one.  If every
+	// field is compared, an identical report is dropped without any
+	// driver calls.
+	changes_only = 0;
+	for (uint32_t i=0; i < TOPUSAGE_LIST_LEN; i++) {
+		USBHIDInput *driver = topusage_drivers[i];
+		if (driver && driver->hid_changed_fields_only()) changes_only |= (1 << i);
+	}
+	history_valid = 0;
+	for (uint32_t pass=0; pass < 2; pass++) {
+		const uint8_t *p = descriptor;
+		uint32_t bitindex[REPORT_LIST_LEN];
+		uint32_t last_usage[REPORT_LIST_LEN];
+		uint8_t collection = TOPUSAGE_LIST_LEN; // none
+		uint8_t topusage_index = 0;
+		uint8_t collection_level = 0;
+		uint16_t usage[USAGE_LIST_LEN] = {0, 0};
+		uint8_t usage_count = 0;
+		uint8_t report = 0;
+		uint16_t report_size = 0;
+		uint16_t report_count = 0;
+		uint16_t usage_page = 0;
+		int32_t logical_min = 0;
+		int32_t logical_max = 0;
+		int32_t physical_min = 0;
+		int32_t physical_max = 0;
+		int8_t unit_exponent = 0;
+		hid_globals_t push_stack[PUSH_STACK_LEN];
+		uint8_t push_count = 0;
+		uint8_t delimiter = 0;
+
+		field_count = 0;
+		field_usage_count = 0;
+		report_field_count = 0;
+		report_buf_count = 0;
+		report_ids[0] = 0;
+		report_list_count = 1;
+		bitindex[0] = 0;
+		last_usage[0] = 0;
+		input_bits[0] = 0;
+		history_any = 0;
+		history_partial = 0;
+		for (uint32_t i=0; i < TOPUSAGE_LIST_LEN; i++) {
+			input_topusage[i] = 0;
+		}
+		while (p < end) {
+			uint8_t tag = *p;
+			if (tag == 0xFE) { // Long Item (unsupported)
+				p += p[1] + 3;
+				continue;
+			}
+			uint32_t val;
+			switch (tag & 0x03) { // Short Item data
+			  case 0: val = 0;
+				p++;
+				break;
+			  case 1: val = p[1];
+				p += 2;
+				break;
+			  case 2: val = p[1] | (p[2] << 8);
+				p += 3;
+				break;
+			  case 3: val = p[1] | (p[2] << 8) | (p[3] << 16) | (p[4] << 24);
+				p += 5;
+				break;
+			}
+			if (p > end) break;
+			bool reset_local = false;
+			switch (tag & 0xFC) {
+			  case 0x04: // Usage Page (global)
+				usage_page = val;
+				break;
+			  case 0x14: // Logical Minimum (global)
+				logical_min = signedval(val, tag);
+				break;
+			  case 0x24: // Logical Maximum (global)
+				logical_max = signedval(val, tag);
+				break;
+			  case 0x74: // Report Size (global)
+				report_size = val;
+				break;
+			  case 0x94: // Report Count (global)
+				report_count = val;
+				break;
+			  case 0x84: // Report ID (global)
+				for (report=0; report < report_list_count; report++) {
+					if (report_ids[report] == (uint8_t)val) break;
+				}
+				if (report == report_list_count) {
+					if (report_list_count >= REPORT_LIST_LEN) return;
+					report_ids[report] = val;
+					bitindex[report] = 0;
+					last_usage[report] = 0;
+					input_bits[report] = 0;
+					report_list_count++;
+				}
+				break;
+			  case 0x34: // Physical Minimum (global)
+				physical_min = signedval(val, tag);
+				break;
+			  case 0x44: // Physical Maximum (global)
+				physical_max = signedval(val, tag);
+				break;
+			  case 0x54: // Unit Exponent (global)
+				unit_exponent = unitexponent(val, tag);
+				break;
+			  case 0xA4: // Push
+				if (push_count < PUSH_STACK_LEN) {
+					hid_globals_t *g = &push_stack[push_count++];
+					g->logical_min = logical_min;
+					g->logical_max = logical_max;
+					g->physical_min = physical_min;
+					g->physical_max = physical_max;
+					g->usage_page = usage_page;
+					g->report_size = report_size;
+					g->report_count = report_count;
+					g->unit_exponent = unit_exponent;
+					g->report = report;
+				}
+				break;
+			  case 0xB4: // Pop
+				if (push_count > 0) {
+					const hid_globals_t *g = &push_stack[--push_count];
+					logical_min = g->logical_min;
+					logical_max = g->logical_max;
+					physical_min = g->physical_min;
+					physical_max = g->physical_max;
+					usage_page = g->usage_page;
+					report_size = g->report_size;
+					report_count = g->report_count;
+					unit_exponent = g->unit_exponent;
+					report = g->report;
+				}
+				break;
+			  case 0xA8: // Delimiter (local)
+				delimiter = val ? 1 : 0;
+				break;
+			  case 0x08: // Usage (local)
+				// only the first usage of a delimited set is used
+				if (delimiter > 1) break;
+				if (delimiter) delimiter = 2;
+				if (usage_count < USAGE_LIST_LEN && val > 0x1f) {
+					usage[usage_count++] = val;
+				}
+				break;
+			  case 0x18: // Usage Minimum (local)
+				usage[0] = val;
+				usage_count = 255;
+				break;
+			  case 0x28: // Usage Maximum (local)
+				usage[1] = val;
+				usage_count = 255;
+				break;
+			  case 0xA0: // Collection
+				if (collection_level == 0) {
+					collection = TOPUSAGE_LIST_LEN;
+					if (topusage_index < TOPUSAGE_LIST_LEN) {
+						input_topusage[topusage_index] = ((uint32_t)usage_page << 16) | usage[0];
+						if (topusage_drivers[topusage_index]) collection = topusage_index;
+						topusage_index++;
+					}
+				}
+				collection_level++;
+				reset_local = true;
+				break;
+			  case 0xC0: // End Collection
+				if (collection_level > 0) {
+					collection_level--;
+					if (collection_level == 0) collection = TOPUSAGE_LIST_LEN;
+				}
+				reset_local = true;
+				break;
+			  case 0x80: // Input
+				if ((val & 1) || collection >= TOPUSAGE_LIST_LEN) {
+					bitindex[report] += report_count * report_size;
+				} else {
+					if (field_count >= FIELD_LIST_LEN) return;
+					if (report_size > 32 || bitindex[report] > 0xFFFF) return;
+					hid_field_t *f = fields ? &fields[field_count] : &unused_field;
+					field_count++;
+					f->logical_min = logical_min;
+					f->logical_max = logical_max;
+					f->physical_min = physical_min;
+					f->physical_max = physical_max;
+					f->unit_exponent = unit_exponent;
+					f->usage_page = usage_page;
+					f->bitindex = bitindex[report];
+					f->count = report_count;
+					f->type = val;
+					f->size = report_size;
+					f->usage_list = 0;
+					f->collection = collection;
+					f->report = report;
+					f->usage_min = 0;
+					f->usage_max = 0xFFFF;
+					if ((val & 2) && !compile_usages(f, usage, usage_count, &last_usage[report])) {
+						return;
+					}
+					bitindex[report] += report_count * report_size;
+					if (bitindex[report] > input_bits[report]) input_bits[report] = bitindex[report];
+					if ((changes_only & (1 << collection)) && !(val & 4)) {
+						history_any |= (1 << report);
+					} else {
+						history_partial |= (1 << report); // relative fields are always delivered
+					}
+				}
+				reset_local = true;
+				break;
+			  case 0x90: // Output
+			  case 0xB0: // Feature
+				for (rb=0; rb < report_buf_count; rb++) {
+					if (report_bufs[rb].id == report_ids[report] &&
+					  report_bufs[rb].type == (tag & 0xFC)) break;
+				}
+				if (rb == report_buf_count && rb < REPORT_BUFFER_LIST_LEN) {
+					report_bufs[rb].id = report_ids[report];
+					report_bufs[rb].type = tag & 0xFC;
+					report_bits[rb] = 0;
+					report_buf_count++;
+				}
+				if (rb < report_buf_count) {
+					// only variable fields can be set by usage
+					if (!(val & 1) && (val & 2) && report_size <= 32
+					  && report_bits[rb] <= 0xFFFF
+					  && report_field_count < REPORT_FIELD_LIST_LEN) {
+						hid_field_t *f = report_fields ? &report_fields[report_field_count] : &unused_field;
+						uint32_t unused_last_usage = 0;
+						f->logical_min = logical_min;
+						f->logical_max = logical_max;
+						f->physical_min = physical_min;
+						f->physical_max = physical_max;
+						f->unit_exponent = unit_exponent;
+						f->usage_page = usage_page;
+						f->bitindex = report_bits[rb];
+						f->count = report_count;
+						f->type = val;
+						f->size = report_size;
+						f->collection = collection;
+						f->report = rb;
+						if (compile_usages(f, usage, usage_count, &unused_last_usage)) {
+							report_field_count++;
+						}
+					}
+					report_bits[rb] += report_count * report_size;
+				}
+				reset_local = true;
+				break;
+			}
+			if (reset_local) {
+				usage_count = 0;
+				usage[0] = 0;
+				usage[1] = 0;
+			}
+		}
+		if (pass > 0) break;
+
+		// Output and Feature reports each get space in report_buffer,
+		// starting with the Report ID byte if the device uses them
+		uint32_t buffer_count = 0;
+		for (uint32_t i=0; i < report_buf_count; i++) {
+			uint32_t len = ((report_bits[i] + 7) >> 3) + (use_report_id ? 1 : 0);
+			report_bufs[i].offset = buffer_count;
+			report_bufs[i].len = (len <= 255) ? len : 0;
+			buffer_count += report_bufs[i].len;
+		}
+		history_skip = 0;
+		uint32_t history_count = 0;
+		for (uint32_t i=0; i < report_list_count; i++) {
+			uint32_t len = (input_bits[i] + 7) >> 3;
+			history_len[i] = 0;
+			if ((history_any & (1 << i)) && len <= 255) {
+				history_offset[i] = history_count;
+				history_len[i] = len;
+				history_count += len;
+				if (!(history_partial & (1 << i))) history_skip |= (1 << i);
+			}
+		}
+		uint32_t size = (field_count + report_field_count) * sizeof(hid_field_t)
+			+ field_usage_count * sizeof(uint16_t) + buffer_count + history_count;
+		table = allocate_Descriptor_Buffer(size, &table_size);
+		if (!table) {
+			println("no memory for HID field table, size = ", size);
+			return;
+		}
+		fields = (hid_field_t *)table;
+		report_fields = fields + field_count;
+		field_usages = (uint16_t *)(report_fields + report_field_count);
+		report_buffer = (uint8_t *)(field_usages + field_usage_count);
+		report_history = report_buffer + buffer_count;
+		memset(report_buffer, 0, buffer_count);
+		for (uint32_t i=0; i < report_buf_count; i++) {
+			if (report_bufs[i].len) report_buffer[report_bufs[i].offset] = report_bufs[i].id;
+		}
+	}
+	// group the fields by report ID, keeping descriptor order
+	for (uint32_t i=1; i < field_count; i++) {
+		hid_field_t f = fields[i];
+		uint32_t j = i;
+		while (j > 0 && fields[j-1].report > f.report) {
+			fields[j] = fields[j-1];
+			j--;
+		}
+		fields[j] = f;
+	}
+	uint32_t n = 0;
+	for (uint32_t i=0; i < report_list_count; i++) {
+		report_first[i] = n;
+		while (n < field_count && fields[n].report == i) n++;
+	}
+	report_first[report_list_count] = field_count;
+	println("compiled HID fields = ", field_count);
+	compiled = true;
+}
+
+// Set the usages of a compiled field, numbered the same way as
+// parse_descriptor() numbers them.  Usage lists are only counted until
+// field_usages has been allocated.  Returns false if there are too many.
+bool USBHIDParser::compile_usages(hid_field_t *f, const uint16_t *usage, uint32_t usage_count,
+	uint32_t *last_usage)
+{
+	bool uminmax = false;
+	uint32_t uindex = 0;
+	uint32_t uindex_max = 0xFFFF;
+	uint32_t count = f->count;
+
+	f->usage_min = 0;
+	f->usage_max = 0xFFFF;
+	f->usage_list = 0;
+	if (usage_count > USAGE_LIST_LEN) {
+		// usage numbers by min/max, not from list
+		uindex = usage[0];
+		uindex_max = usage[1];
+		uminmax = true;
+	} else if ((count > 1) && (usage_count <= 1)) {
+		if (usage_count == 1) {
+			uindex = usage[0];
+		} else {
+			uindex = (*last_usage & 0xff00) + 0x100;
+		}
+		uminmax = true;
+	}
+	if (uminmax) {
+		f->usage_min = uindex;
+		f->usage_max = uindex_max;
+		if (count > 0) {
+			uint32_t u = uindex;
+			if (uindex < uindex_max) {
+				u = uindex + count - 1;
+				if (u > uindex_max) u = uindex_max;
+			}
+			*last_usage = u;
+		}
+	} else if (count > 0) {
+		// the usage list, but the last one
+		// repeats after USAGE_LIST_LEN
+		uint32_t n = count;
+		if (n > USAGE_LIST_LEN) n = USAGE_LIST_LEN;
+		if (field_usage_count + n > FIELD_USAGE_LEN) return false;
+		f->usage_min = field_usage_count;
+		f->usage_list = n;
+		if (field_usages) {
+			for (uint32_t i=0; i < n; i++) {
+				field_usages[field_usage_count + i] = usage[i];
+			}
+		}
+		field_usage_count += n;
+		*last_usage = usage[n - 1];
+	}
+	return true;
+}
+
+// Feed the fields of an incoming report to the drivers which have claimed
+// its top level collections, using the table made by compile().
+void USBHIDParser::parse(uint16_t type_and_report_id, const uint8_t *data, uint32_t len)
+{
+	if (!compiled) {
+		parse_descriptor(type_and_report_id, data, len);
+		return;
+	}
+	const hid_field_t *f = fields;
+	const hid_field_t *end = fields;
+	uint32_t report = 0;
+	if (use_report_id) {
+		// report_ids[0] only holds fields before the first Report ID
+		// item, so it is not an ID the device may send
+		uint8_t id = type_and_report_id;
+		for (report=1; report < report_list_count; report++) {
+			if (report_ids[report] == id) break;
+		}
+		if (report >= report_list_count) {
+			// Report ID not in the descriptor
+			unknown_report_ids++;
+			return;
+		}
+		f = fields + report_first[report];
+		end = fields + report_first[report + 1];
+	} else {
+		end = fields + field_count;
+	}
+	const uint8_t *prev = NULL;
+	uint32_t history = history_len[report];
+	if (history > len) history = 0; // short report, do not compare
+	if (history && (history_valid & (1 << report))) {
+		prev = report_history + history_offset[report];
+		if ((history_skip & (1 << report)) && memcmp(prev, data, history) == 0) {
+			return; // nothing changed
+		}
+	}
+	uint32_t collection = 0;
+	for (; f < end; f++) {
+		// fields are in descriptor order, so every collection before
+		// this field's collection has ended
+		for (; collection < f->collection; collection++) {
+			if (topusage_drivers[collection]) topusage_drivers[collection]->hid_input_end();
+		}
+		USBHIDInput *driver = topusage_drivers[f->collection];
+		if (driver == NULL) continue;
+		driver->input_physical_min = f->physical_min;
+		driver->input_physical_max = f->physical_max;
+		driver->input_unit_exponent = f->unit_exponent;
+		uint32_t bitindex = f->bitindex;
+		uint32_t size = f->size;
+		uint32_t usage_page = (uint32_t)f->usage_page << 16;
+		// compare with the previous report only for absolute
+		// fields of drivers which asked for changes only
+		const uint8_t *compare = NULL;
+		if (prev && (changes_only & (1 << f->collection)) && !(f->type & 4)) {
+			compare = prev;
+		}
+		if (compare && !(f->type & 2)) {
+			// array format changes as a whole
+			uint32_t i;
+			for (i=0; i < f->count; i++) {
+				uint32_t b = bitindex + i * size;
+				if (bitfield(data, b, size) != bitfield(compare, b, size)) break;
+			}
+			if (i == f->count) continue;
+			compare = NULL;
+		}
+		if (!compare) {
+			driver->input_timestamp = report_timestamp;
+			driver->hid_input_begin(input_topusage[f->collection], f->type, f->logical_min, f->logical_max);
+		}
+		if (f->type & 2) {
+			// ordinary variable format
+			bool begin = (compare == NULL);
+			uint32_t uindex = f->usage_min;
+			for (uint32_t i=0; i < f->count; i++) {
+				uint32_t u;
+				if (f->usage_list) {
+					u = field_usages[f->usage_min + ((i < f->usage_list) ? i : f->usage_list - 1)];
+				} else {
+					u = uindex;
+					if (uindex < f->usage_max) uindex++;
+				}
+				uint32_t n = bitfield(data, bitindex, size);
+				if (compare) {
+					if (n == bitfield(compare, bitindex, size)) {
+						bitindex += size;
+						continue;
+					}
+					if (!begin) {
+						driver->input_timestamp = report_timestamp;
+						driver->hid_input_begin(input_topusage[f->collection], f->type, f->logical_min, f->logical_max);
+						begin = true;
+					}
+				}
+				if (f->logical_min >= 0) {
+					driver->hid_input_data(u | usage_page, n);
+				} else {
+					driver->hid_input_data(u | usage_page, signext(n, size));
+				}
+				bitindex += size;
+			}
+		} else {
+			// array format, each item is a usage number
+			for (uint32_t i=0; i < f->count; i++) {
+				uint32_t u = bitfield(data, bitindex, size);
+				int n = u;
+				if (n >= f->logical_min && n <= f->logical_max) {
+					driver->hid_input_data(u | usage_page, 1);
+				}
+				bitindex += size;
+			}
+		}
+	}
+	for (; collection < TOPUSAGE_LIST_LEN; collection++) {
+		if (topusage_drivers[collection]) topusage_drivers[collection]->hid_input_end();
+	}
+	if (history) {
+		memcpy(report_history + history_offset[report], data, history);
+		history_valid |= (1 << report);
+	} else {
+		history_valid &= ~(1 << report);
+	}
+}
+
+// Store the low numbits of value into the data array, starting at bitindex.
+static void setbitfield(uint8_t *data, uint32_t bitindex, uint32_t numbits, uint32_t value)
+{
+	for (uint32_t i=0; i < numbits; i++, bitindex++) {
+		uint8_t mask = 1 << (bitindex & 7);
+		if (value & (1u << i)) {
+			data[bitindex >> 3] |= mask;
+		} else {
+			data[bitindex >> 3] &= ~mask;
+		}
+	}
+}
+
+// Find the Output (0x90) or Feature (0xB0) field holding a usage, and the
+// bit within report_buffer where that usage's value is stored.
+USBHIDParser::hid_field_t * USBHIDParser::find_report_field(uint32_t type, uint32_t usage,
+	uint32_t *bitindex)
+{
+	if (!compiled) return NULL;
+	for (uint32_t n=0; n < report_field_count; n++) {
+		hid_field_t *f = &report_fields[n];
+		const hid_report_buf_t *rb = &report_bufs[f->report];
+		if (rb->type != type || rb->len == 0) continue;
+		if ((usage >> 16) != f->usage_page) continue;
+		uint32_t uindex = f->usage_min;
+		for (uint32_t i=0; i < f->count; i++) {
+			uint32_t u;
+			if (f->usage_list) {
+				u = field_usages[f->usage_min + ((i < f->usage_list) ? i : f->usage_list - 1)];
+			} else {
+				u = uindex;
+				if (uindex < f->usage_max) uindex++;
+			}
+			if (u == (usage & 0xFFFF)) {
+				*bitindex = (rb->offset + (use_report_id ? 1 : 0)) * 8
+					+ f->bitindex + i * f->size;
+				return f;
+			}
+		}
+	}
+	return NULL;
+}
+
+bool USBHIDParser::set_report_field(uint32_t type, uint32_t usage, int32_t value)
+{
+	uint32_t bitindex;
+	if (setup_busy) return false; // report_buffer may be in use
+	hid_field_t *f = find_report_field(type, usage, &bitindex);
+	if (!f) return false;
+	setbitfield(report_buffer, bitindex, f->size, value);
+	return true;
+}
+
+// Send the Output or Feature report holding a usage.  Output reports use
+// the interrupt OUT endpoint if the device has one, otherwise SET_REPORT.
+bool USBHIDParser::send_report(uint32_t type, uint32_t usage)
+{
+	uint32_t bitindex;
+	hid_field_t *f = find_report_field(type, usage, &bitindex);
+	if (!f) return false;
+	const hid_report_buf_t *rb = &report_bufs[f->report];
+	uint8_t *buf = report_buffer + rb->offset;
+	if (type == 0x90 && out_pipe && rb->len <= out_size) {
+		return sendPacket(buf, rb->len);
+	}
+	if (setup_busy) return false;
+	uint32_t wValue = ((type == 0x90) ? 0x0200 : 0x0300) | rb->id;
+	mk_setup(setup, 0x21, 9, wValue, bInterfaceNumber, rb->len); // SET_REPORT
+	return queue_setup(device, buf);
+}
+
+bool USBHIDParser::setOutput(uint32_t usage, int32_t value)
+{
+	return set_report_field(0x90, usage, value);
+}
+
+bool USBHIDParser::sendOutput(uint32_t usage)
+{
+	return send_report(0x90, usage);
+}
+
+bool USBHIDParser::setFeature(uint32_t usage, int32_t value)
+{
+	return set_report_field(0xB0, usage, value);
+}
+
+bool USBHIDParser::sendFeature(uint32_t usage)
+{
+	return send_report(0xB0, usage);
+}
+
+// Read the Feature report holding a usage from the device, with
+// GET_REPORT.  getFeature() returns the new value once reportBusy()
+// is false again.
+bool USBHIDParser::requestFeature(uint32_t usage)
+{
+	if (setup_busy) return false;
+	uint32_t bitindex;
+	hid_field_t *f = find_report_field(0xB0, usage, &bitindex);
+	if (!f) return false;
+	const hid_report_buf_t *rb = &report_bufs[f->report];
+	mk_setup(setup, 0xA1, 1, 0x0300 | rb->id, bInterfaceNumber, rb->len); // GET_REPORT
+	return queue_setup(device, report_buffer + rb->offset);
+}
+
+int32_t USBHIDParser::getFeature(uint32_t usage)
+{
+	uint32_t bitindex;
+	hid_field_t *f = find_report_field(0xB0, usage, &bitindex);
+	if (!f) return 0;
+	uint32_t n = bitfield(report_buffer, bitindex, f->size);
+	if (f->logical_min >= 0) return n;
+	return signext(n, f->size);
+}
@@ -32,12 +32,20 @@ volatile bool USBHub::reset_busy = false;
 #define print   USBHost::print_
 #define println USBHost::println_
 
+// Hubs are claimed at device level, bDeviceClass 9
+static const driver_match_t hub_match[] = {
+	{driver_match_t::DEVICE, driver_match_t::CLASS | driver_match_t::SUBCLASS, 0, 0, 9, 0, 0}
+};
+
 void USBHub::init()
 {
+#ifndef USBHOST_NO_DRIVER_MEMORY
 	contribute_Devices(mydevices, sizeof(mydevices)/sizeof(Device_t));
-	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+	contribute_Pipes(mypipes, myqhs, sizeof(mypipes)/sizeof(Pipe_t));
+	contribute_Transfers(mytransfers, myqtds, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+#endif
+	match_table(hub_match, sizeof(hub_match)/sizeof(driver_match_t));
 	driver_ready_for_device(this);
 }
 
@@ -66,13 +74,14 @@ bool USBHub::claim(Device_t *dev, int type, const uint8_t *d, uint32_t len)
 		  d[9] == 7 && d[10] == 5 &&		// valid endpoint descriptor
 		  (d[11] & 0xF0) == 0x80 &&		// endpoint direction is IN
 		  d[12] == 3 &&				// endpoint type is interrupt
-		  d[13] == 1 && d[14] == 0) {		// max packet size is 1 byte
+		  d[13] >= 1 && d[13] <= 4 && d[14] == 0) { // max packet fits changebits
 			println("found possible interface, altsetting=", d[3]);
 			if (interface_count == 0) {
 				interface_number = d[2];
 				altsetting = d[3];
 				protocol = d[7];
 				endpoint = d[11] & 0x0F;
+				changelen = d[13];
 				interval = d[15];
 			} else {
 				if (d[2] != interface_number) break;
@@ -80,6 +89,7 @@ bool USBHub::claim(Device_t *dev, int type, const uint8_t *d, uint32_t len)
 					altsetting = d[3];
 					protocol = d[7];
 					endpoint = d[11] & 0x0F;
+					changelen = d[13];
 					interval = d[15];
 				}
 			}
@@ -128,18 +138,25 @@ void USBHub::send_poweron(uint32_t port)
 	}
 }
 
+// Status requests have their own setup packet and buffer for each port,
+// so they do not wait for can_send_control_now().  Up to
+// MAX_GETSTATUS_INFLIGHT may be queued on the control pipe at once, but
+// only one per port.  The rest are sent from control() as others finish.
 void USBHub::send_getstatus(uint32_t port)
 {
 	if (port > numports) return;
-	if (can_send_control_now()) {
-		println("getstatus, port = ", port);
-		mk_setup(setup, ((port > 0) ? 0xA3 : 0xA0), 0, 0, port, 4);
-		queue_Control_Transfer(device, &setup, &statusbits, this);
-		send_pending_getstatus &= ~(1 << port);
-	} else {
-		println("deferred getstatus, port = ", port);
-		send_pending_getstatus |= (1 << port);
+	if (!(send_inflight_getstatus & (1 << port))
+	  && __builtin_popcount(send_inflight_getstatus) < MAX_GETSTATUS_INFLIGHT) {
+		mk_setup(statussetup[port], ((port > 0) ? 0xA3 : 0xA0), 0, 0, port, 4);
+		if (queue_Control_Transfer(device, &statussetup[port], &statusbits[port], this)) {
+			println("getstatus, port = ", port);
+			send_inflight_getstatus |= (1 << port);
+			send_pending_getstatus &= ~(1 << port);
+			return;
+		}
 	}
+	println("deferred getstatus, port = ", port);
+	send_pending_getstatus |= (1 << port);
 }
 
 void USBHub::send_clearstatus_connect(uint32_t port)
@@ -233,13 +250,21 @@ void USBHub::control(const Transfer_t *transfer)
 	println("USBHub control callback");
 	print_hexbytes(transfer->buffer, transfer->length);
 
-	sending_control_transfer = 0;
 	uint32_t port = transfer->setup.wIndex;
 	uint32_t mesg = transfer->setup.word1;
+	if (mesg == 0x000000A0 || mesg == 0x000000A3) {
+		send_inflight_getstatus &= ~(1 << port);
+	} else {
+		sending_control_transfer = 0;
+	}
 
 	switch (mesg) {
 	  case 0x290006A0: // read hub descriptor
 		numports = hub_desc[2];
+		if (numports > MAXPORTS) {
+			println("Hub has too many ports, using only ", MAXPORTS);
+			numports = MAXPORTS;
+		}
 		characteristics = hub_desc[3];
 		powertime = hub_desc[5];
 		if (interface_count > 1) {
@@ -256,10 +281,11 @@ void USBHub::control(const Transfer_t *transfer)
 		if (port == numports && changepipe == NULL) {
 			println("power turned on to all ports");
 			println("device addr = ", device->address);
-			changepipe = new_Pipe(device, 3, endpoint, 1, 1, interval);
-			println("pipe cap1 = ", changepipe->qh.capabilities[0], HEX);
+			changepipe = new_Pipe(device, 3, endpoint, 1, changelen, interval);
+			if (!changepipe) break;
+			println("pipe cap1 = ", changepipe->qh->capabilities[0], HEX);
 			changepipe->callback_function = callback;
-			queue_Data_Transfer(changepipe, &changebits, 1, this);
+			queue_Data_Transfer(changepipe, &changebits, changelen, this);
 		}
 		break;
 
@@ -270,7 +296,7 @@ void USBHub::control(const Transfer_t *transfer)
 		println("New Port Status");
 		if (transfer->length == 4) {
 			uint32_t status = *(uint32_t *)(transfer->buffer);
-			if (status != statusbits) println("ERROR: status not same");
+			if (status != statusbits[port]) println("ERROR: status not same");
 			new_port_status(port, status);
 		}
 		//if (changebits & (1 << port)) {
@@ -287,6 +313,16 @@ void USBHub::control(const Transfer_t *transfer)
 	  default:
 		println("unhandled setup, message = ", mesg, HEX);
 	}
+	// Status requests which could not be queued earlier, or
+	// which were requested again while already in flight.
+	while (send_pending_getstatus
+	  && __builtin_popcount(send_inflight_getstatus) < MAX_GETSTATUS_INFLIGHT) {
+		portbitmask_t ready = send_pending_getstatus & ~send_inflight_getstatus;
+		if (!ready) break;
+		portbitmask_t before = send_inflight_getstatus;
+		send_getstatus(lowestbit(ready));
+		if (send_inflight_getstatus == before) break; // could not queue
+	}
 	// After we've completed processing for this control
 	// transfer, check if any more need to be sent.  These
 	// allow only a single control transfer to occur at once
@@ -305,8 +341,6 @@ void USBHub::control(const Transfer_t *transfer)
 		send_clearstatus_overcurrent(lowestbit(send_pending_clearstatus_overcurrent));
 	} else if (send_pending_clearstatus_reset) {
 		send_clearstatus_reset(lowestbit(send_pending_clearstatus_reset));
-	} else if (send_pending_getstatus) {
-		send_getstatus(lowestbit(send_pending_getstatus));
 	} else if (send_pending_setreset) {
 		send_setreset(lowestbit(send_pending_setreset));
 	}
@@ -327,7 +361,8 @@ void USBHub::status_change(const Transfer_t *transfer)
 			send_getstatus(i);
 		}
 	}
-	queue_Data_Transfer(changepipe, &changebits, 1, this);
+	changebits = 0; // hub may send fewer than changelen bytes
+	queue_Data_Transfer(changepipe, &changebits, changelen, this);
 }
 
 void USBHub::new_port_status(uint32_t port, uint32_t status)
@@ -366,6 +401,10 @@ void USBHub::new_port_status(uint32_t port, uint32_t status)
 	  case PORT_DISCONNECT:
 		if (status & 0x0001) { // connected
 			state = PORT_DEBOUNCE1;
+#ifdef USBHOST_ENUM_TIMING
+			connect_micros[port-1] = micros();
+			debounce_micros[port-1] = 0;
+#endif
 			start_debounce_timer(port);
 			send_clearstatus_connect(port);
 		}
@@ -374,24 +413,26 @@ void USBHub::new_port_status(uint32_t port, uint32_t status)
 	  case PORT_DEBOUNCE2:
 	  case PORT_DEBOUNCE3:
 	  case PORT_DEBOUNCE4:
+		// The debounce timer advances these states without
+		// reading status.  A disconnect sets C_PORT_CONNECTION,
+		// which the hub reports in its change bitmap.
+		if (!(status & 0x0001)) {
+			stop_debounce_timer(port);
+			state = PORT_DISCONNECT;
+		}
+		break;
 	  case PORT_DEBOUNCE5:
 		if (status & 0x0001) {
-			if (++state > PORT_DEBOUNCE5) {
-				if (USBHub::reset_busy || USBHost::enumeration_busy) {
-					// wait in debounce state if another port is
-					// resetting or a device is busy enumerating
-					state = PORT_DEBOUNCE5;
-					break;
-				}
-				USBHub::reset_busy = true;
-				stop_debounce_timer(port);
-				state = PORT_RESET;
-				println("sending reset");
-				send_setreset(port);
-				port_doing_reset = port;
-			}
+			// connection stable, wait for our turn to reset
+#ifdef USBHOST_ENUM_TIMING
+			if (debounce_micros[port-1] == 0) debounce_micros[port-1] = micros();
+#endif
+			stop_debounce_timer(port);
+			reset_waiting |= (1 << port);
+			start_next_reset();
 		} else {
 			stop_debounce_timer(port);
+			reset_waiting &= ~(1 << port);
 			state = PORT_DISCONNECT;
 		}
 		break;
@@ -404,6 +445,10 @@ void USBHub::new_port_status(uint32_t port, uint32_t status)
 			if (status & 0x0200) speed = 1;
 			else if (status & 0x0400) speed = 2;
 			port_doing_reset_speed = speed;
+#ifdef USBHOST_ENUM_TIMING
+			port_timing.usec[enum_timing_t::RECOVERY] = micros();
+#endif
+			resettimer.stop(); // may be waiting in start_next_reset
 			resettimer.start(25000);
 		} else if (!(status & 0x0001)) {
 			send_clearstatus_connect(port);
@@ -445,9 +490,18 @@ void USBHub::timer_event(USBDriverTimer *timer)
 		println("ports in use bitmask = ", in_use, HEX);
 		if (in_use) {
 			for (uint32_t i=1; i <= numports; i++) {
-				if (in_use & (1 << i)) send_getstatus(i);
+				if (!(in_use & (1 << i))) continue;
+				uint8_t &state = portstate[i-1];
+				if (state < PORT_DEBOUNCE5) {
+					state++;
+				} else {
+					// read status once, to confirm the device
+					// is still connected before reset
+					stop_debounce_timer(i);
+					send_getstatus(i);
+				}
 			}
-			debouncetimer.start(20000);
+			if (debounce_in_use) debouncetimer.start(20000);
 		}
 	} else if (timer == &resettimer) {
 		uint8_t port = port_doing_reset;
@@ -470,6 +524,7 @@ void USBHub::timer_event(USBDriverTimer *timer)
 				state = PORT_ACTIVE;
 			}
 		}
+		start_next_reset();
 	}
 
 	// TODO: testing only!!!
@@ -479,7 +534,10 @@ void USBHub::timer_event(USBDriverTimer *timer)
 
 void USBHub::start_debounce_timer(uint32_t port)
 {
-	if (debounce_in_use == 0) debouncetimer.start(20000);
+	if (debounce_in_use == 0) {
+		debouncetimer.stop();
+		debouncetimer.start(20000);
+	}
 	debounce_in_use |= (1 << port);
 }
 
@@ -489,12 +547,43 @@ void USBHub::stop_debounce_timer(uint32_t port)
 }
 
 
+// Reset the lowest numbered port which finished debounce.  Only one
+// port on any hub may be reset at a time, so if another is busy, check
+// again in 1 ms rather than waiting for the next debounce interval.
+void USBHub::start_next_reset()
+{
+	if (!reset_waiting || port_doing_reset) return;
+	if (USBHub::reset_busy || USBHost::enumeration_busy) {
+		// another port is resetting, a device is using
+		// address zero, or no enumeration buffer is free
+		resettimer.stop();
+		resettimer.start(1000);
+		return;
+	}
+	uint32_t port = lowestbit(reset_waiting);
+	reset_waiting &= ~(1 << port);
+	USBHub::reset_busy = true;
+	portstate[port-1] = PORT_RESET;
+	println("sending reset");
+	send_setreset(port);
+	port_doing_reset = port;
+#ifdef USBHOST_ENUM_TIMING
+	memset(&port_timing, 0, sizeof(port_timing));
+	port_timing.usec[enum_timing_t::CONNECT] = connect_micros[port-1];
+	port_timing.usec[enum_timing_t::DEBOUNCE] = debounce_micros[port-1];
+	port_timing.usec[enum_timing_t::RESET] = micros();
+#endif
+}
+
 void USBHub::disconnect()
 {
 	// disconnect all downstream devices, which may be more hubs
 	for (uint32_t i=0; i < numports; i++) {
 		if (devicelist[i]) disconnect_Device(devicelist[i]);
 	}
+	if (port_doing_reset) USBHub::reset_busy = false;
+	debouncetimer.stop();
+	resettimer.stop();
 	numports = 0;
 	changepipe = NULL;
 	changebits = 0;
@@ -510,7 +599,9 @@ void USBHub::disconnect()
 	send_pending_clearstatus_overcurrent = 0;
 	send_pending_clearstatus_reset = 0;
 	send_pending_setreset = 0;
+	send_inflight_getstatus = 0;
 	debounce_in_use = 0;
+	reset_waiting = 0;
 }
 
 
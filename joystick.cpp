@@ -54,9 +54,12 @@ JoystickController::product_vendor_mapping_t JoystickController::pid_vid_mapping
 //-----------------------------------------------------------------------------
 void JoystickController::init()
 {
-	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	contribute_Pipes(mypipes, myqhs, sizeof(mypipes)/sizeof(Pipe_t));
+	contribute_Transfers(mytransfers, myqtds, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+#endif
+	match_ids(pid_vid_mapping, driver_match_t::INTERFACE);
 	driver_ready_for_device(this);
 	USBHIDParser::driver_ready_for_hid_collection(this);
 	BluetoothController::driver_ready_for_bluetooth(this);
@@ -95,6 +98,8 @@ uint16_t JoystickController::idProduct()
 
 const uint8_t *JoystickController::manufacturer()
 {
+	request_strings(device);
+	request_strings(mydevice);
 	if ((device != nullptr) && (device->strbuf != nullptr)) return &device->strbuf->buffer[device->strbuf->iStrings[strbuf_t::STR_ID_MAN]];
 	//if ((btdevice != nullptr) && (btdevice->strbuf != nullptr)) return &btdevice->strbuf->buffer[btdevice->strbuf->iStrings[strbuf_t::STR_ID_MAN]]; 
 	if ((mydevice != nullptr) && (mydevice->strbuf != nullptr)) return &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_MAN]]; 
@@ -103,6 +108,8 @@ const uint8_t *JoystickController::manufacturer()
 
 const uint8_t *JoystickController::product()
 {
+	request_strings(device);
+	request_strings(mydevice);
 	if ((device != nullptr) && (device->strbuf != nullptr)) return &device->strbuf->buffer[device->strbuf->iStrings[strbuf_t::STR_ID_PROD]];
 	if ((mydevice != nullptr) && (mydevice->strbuf != nullptr)) return &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_PROD]]; 
 	if (btdevice != nullptr) return remote_name_;
@@ -111,6 +118,8 @@ const uint8_t *JoystickController::product()
 
 const uint8_t *JoystickController::serialNumber()
 {
+	request_strings(device);
+	request_strings(mydevice);
 	if ((device != nullptr) && (device->strbuf != nullptr)) return &device->strbuf->buffer[device->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]];
 	if ((mydevice != nullptr) && (mydevice->strbuf != nullptr)) return &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]]; 
 	return nullptr;
@@ -514,6 +523,19 @@ void JoystickController::hid_input_end()
 	if (anychange) {
 		joystickEvent = true;
 	}
+	queue_button_event();
+}
+
+// Give the event queue any change of the buttons since the last event
+void JoystickController::queue_button_event()
+{
+	if (buttons == event_buttons) return;
+	joystick_event_t event;
+	event.buttons = buttons;
+	event.changed = buttons ^ event_buttons;
+	event.timestamp = input_timestamp;
+	event_buttons = buttons;
+	events.write(event);
 }
 
 bool JoystickController::hid_process_out_data(const Transfer_t *transfer) 
@@ -552,7 +574,8 @@ void JoystickController::joystickDataClear() {
 	joystickEvent = false;
 	anychange = false;
 	axis_changed_mask_ = 0;
-	axis_mask_ = 0;
+	// axis_mask_ is kept, since axis[] keeps its values and HID
+	// joysticks only receive the axes which change
 }
 
 //*****************************************************************************
@@ -768,6 +791,7 @@ void JoystickController::rx_data(const Transfer_t *transfer)
 	print_hexbytes((uint8_t*)transfer->buffer, transfer->length);
 	#endif
 
+	input_timestamp = transfer->timestamp;
 	if (joystickType_ == XBOXONE) {
 		// Process XBOX One data
 		axis_mask_ = 0x3f;	
@@ -878,6 +902,7 @@ void JoystickController::rx_data(const Transfer_t *transfer)
 		if (anychange) joystickEvent = true;
 	}
 
+	queue_button_event();
 	queue_Data_Transfer(rxpipe_, rxbuf_, rx_size_, this);
 }
 
@@ -1027,6 +1052,7 @@ bool JoystickController::process_bluetooth_HID_data(const uint8_t *data, uint16_
 		if (axis_changed_mask_ & axis_change_notify_mask_)
 			joystickEvent = true;
 		connected_ = true;
+		queue_button_event();
 		return true;
 
 	} else if(data[0] == 0x11){
@@ -1122,6 +1148,7 @@ bool JoystickController::process_bluetooth_HID_data(const uint8_t *data, uint16_
 		//DBGPrintf("Axis Mask (axis_mask_, axis_changed_mask_; %d, %d\n", axis_mask_,axis_changed_mask_);
 		joystickEvent = true;
 		connected_ = true;
+		queue_button_event();
 	}
 	return false;
 }
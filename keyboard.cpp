@@ -105,11 +105,20 @@ static const keyboard_force_boot_protocol_t keyboard_forceBootMode[] = {
 
 
 
+// HID Boot Protocol keyboards
+static const driver_match_t keyboard_match[] = {
+	{driver_match_t::INTERFACE, driver_match_t::CLASS | driver_match_t::SUBCLASS
+		| driver_match_t::PROTOCOL, 0, 0, 3, 1, 1}
+};
+
 void KeyboardController::init()
 {
-	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	contribute_Pipes(mypipes, myqhs, sizeof(mypipes)/sizeof(Pipe_t));
+	contribute_Transfers(mytransfers, myqtds, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+#endif
+	match_table(keyboard_match, sizeof(keyboard_match)/sizeof(driver_match_t));
 	driver_ready_for_device(this);
 	USBHIDParser::driver_ready_for_hid_collection(this);
 	BluetoothController::driver_ready_for_bluetooth(this);
@@ -219,6 +228,8 @@ void KeyboardController::forceBootProtocol()
 void KeyboardController::disconnect()
 {
 	// TODO: free resources
+	memset(boot_keys_state, 0, sizeof(boot_keys_state));
+	memcpy(keys_state, report_keys_state, sizeof(keys_state));
 }
 
 
@@ -232,56 +243,86 @@ void __keyboardControllerEmptyCallback() { }
 void keyPressed()  __attribute__ ((weak, alias("__keyboardControllerEmptyCallback")));
 void keyReleased() __attribute__ ((weak, alias("__keyboardControllerEmptyCallback")));
 
-static bool contains(uint8_t b, const uint8_t *data)
+// Key state is kept as a 256 bit set, one bit per key code.  The
+// modifier keys (0xE0 to 0xE7) are the low 8 bits of the last word,
+// matching the modifier byte of boot protocol reports.
+static void boot_report_to_keys(const uint8_t *data, uint32_t *keys)
 {
-	if (data[2] == b || data[3] == b || data[4] == b) return true;
-	if (data[5] == b || data[6] == b || data[7] == b) return true;
-	return false;
+	memset(keys, 0, 32);
+	for (int i=2; i < 8; i++) {
+		uint32_t key = data[i];
+		keys[key >> 5] |= 1u << (key & 31);
+	}
+	keys[7] |= data[0];
 }
 
-void KeyboardController::new_data(const Transfer_t *transfer)
+// Store the keys down from one source, then report every key which
+// changed: all releases, then all presses, each in order of key code.
+// Boot and report protocol keys are kept separately, since some
+// keyboards send both, and a key down in either is down only once.
+void KeyboardController::update_keys(const uint32_t *keys, uint32_t *source)
 {
-	println("KeyboardController Callback (member)");
-	print("  KB Data: ");
-	print_hexbytes(transfer->buffer, 8);
-	for (int i=2; i < 8; i++) {
-		uint32_t key = prev_report[i];
-		if (key >= 4 && !contains(key, report)) {
-			key_release(prev_report[0], key);
-			if (rawKeyReleasedFunction) {
-				rawKeyReleasedFunction(key);
-			}
-		}
+	// ErrorRollOver means too many keys are down to know which ones
+	if (keys[0] & 2) return;
+	memcpy(source, keys, 32);
+	uint32_t down[8];
+	for (int w=0; w < 8; w++) {
+		down[w] = boot_keys_state[w] | report_keys_state[w];
 	}
-	if (rawKeyReleasedFunction) {
-		// each modifier key is represented by a bit in the first byte
-		for (int i = 0; i < 8; ++i)
-		{
-			uint8_t keybit = 1 << i;
-			if ((prev_report[0] & keybit) && !(report[0] & keybit)) {
-				rawKeyReleasedFunction(103 + i);
+	const uint32_t *state = keys_state;
+	uint32_t prev_mod = state[7] & 0xFF;
+	uint32_t mod = down[7] & 0xFF;
+	for (int w=0; w < 8; w++) {
+		uint32_t released = (state[w] ^ down[w]) & state[w];
+		while (released) {
+			uint32_t key = w * 32 + __builtin_ctz(released);
+			released &= released - 1;
+			if (key >= 4) key_event(key, mod, false);
+			if (key >= 0xE0) {
+				// each modifier key is represented by a bit in the first byte
+				if (rawKeyReleasedFunction) rawKeyReleasedFunction(103 + key - 0xE0);
+			} else if (key >= 4) {
+				key_release(prev_mod, key);
+				if (rawKeyReleasedFunction) rawKeyReleasedFunction(key);
 			}
 		}
 	}
-	for (int i=2; i < 8; i++) {
-		uint32_t key = report[i];
-		if (key >= 4 && !contains(key, prev_report)) {
-			key_press(report[0], key);
-			if (rawKeyPressedFunction) {
-				rawKeyPressedFunction(key);
+	for (int w=0; w < 8; w++) {
+		uint32_t pressed = (state[w] ^ down[w]) & down[w];
+		while (pressed) {
+			uint32_t key = w * 32 + __builtin_ctz(pressed);
+			pressed &= pressed - 1;
+			if (key >= 4) key_event(key, mod, true);
+			if (key >= 0xE0) {
+				if (rawKeyPressedFunction) rawKeyPressedFunction(103 + key - 0xE0);
+			} else if (key >= 4) {
+				key_press(mod, key);
+				if (rawKeyPressedFunction) rawKeyPressedFunction(key);
 			}
 		}
 	}
-	if (rawKeyPressedFunction) {
-		for (int i = 0; i < 8; ++i)
-		{
-			uint8_t keybit = 1 << i;
-			if (!(prev_report[0] & keybit) && (report[0] & keybit)) {
-				rawKeyPressedFunction(103 + i);
-			}
-		}
-	}
-	memcpy(prev_report, report, 8);
+	memcpy(keys_state, down, 32);
+}
+
+void KeyboardController::key_event(uint32_t key, uint32_t mod, bool pressed)
+{
+	keyboard_event_t event;
+	event.keycode = key;
+	event.modifiers = mod;
+	event.pressed = pressed;
+	event.timestamp = input_timestamp;
+	events.write(event);
+}
+
+void KeyboardController::new_data(const Transfer_t *transfer)
+{
+	println("KeyboardController Callback (member)");
+	print("  KB Data: ");
+	print_hexbytes(transfer->buffer, 8);
+	uint32_t keys[8];
+	input_timestamp = transfer->timestamp;
+	boot_report_to_keys(report, keys);
+	update_keys(keys, boot_keys_state);
 	queue_Data_Transfer(datapipe, report, 8, this);
 }
 
@@ -424,6 +465,7 @@ void KeyboardController::updateLEDS() {
 
 #define TOPUSAGE_SYS_CONTROL 	0x10080
 #define TOPUSAGE_CONSUMER_CONTROL	0x0c0001
+#define TOPUSAGE_KEYBOARD		0x10006
 
 hidclaim_t KeyboardController::claim_collection(USBHIDParser *driver, Device_t *dev, uint32_t topusage)
 {
@@ -431,11 +473,15 @@ hidclaim_t KeyboardController::claim_collection(USBHIDParser *driver, Device_t *
 	//USBHDBGSerial.printf("KBH Claim %x\n", topusage);
 	if ((topusage != TOPUSAGE_SYS_CONTROL) 
 		&& (topusage != TOPUSAGE_CONSUMER_CONTROL)
+		&& (topusage != TOPUSAGE_KEYBOARD)
 		) return CLAIM_NO;
 	// only claim from one physical device
 	//USBHDBGSerial.println("KeyboardController claim collection");
 	// Lets only claim if this is the same device as claimed Keyboard... 
-	if (dev != device) return CLAIM_NO;
+	// Report protocol keyboards (often N-key rollover) may have no
+	// boot interface, so their keyboard collection is claimed alone.
+	if (dev != device && !(topusage == TOPUSAGE_KEYBOARD && device == nullptr
+		&& btdevice == nullptr)) return CLAIM_NO;
 	if (mydevice != NULL && dev != mydevice) return CLAIM_NO;
 	mydevice = dev;
 	collections_claimed_++;
@@ -446,6 +492,10 @@ void KeyboardController::disconnect_collection(Device_t *dev)
 {
 	if (--collections_claimed_ == 0) {
 		mydevice = NULL;
+		memset(report_keys_state, 0, sizeof(report_keys_state));
+		memcpy(keys_state, boot_keys_state, sizeof(keys_state));
+		memset(report_keys, 0, sizeof(report_keys));
+		report_keys_valid_ = false;
 	}
 }
 
@@ -463,6 +513,18 @@ void KeyboardController::hid_input_data(uint32_t usage, int32_t value)
 	if ((usage & 0xffff0000) == 0xff000000) return; 
 	//USBHDBGSerial.printf("KeyboardController: topusage= %x usage=%X, value=%d\n", topusage_, usage, value);
 
+	// Keyboard collections may send a bitmap of every key (N-key
+	// rollover) or an array of key codes.  Either way, collect the
+	// keys down into a bit set, compared to the last at hid_input_end.
+	// The parser gives 0x10000 as topusage for keyboards (usages below
+	// 0x20 are not remembered), so look for the keyboard usage page.
+	if ((usage >> 16) == 7) {
+		uint32_t key = usage & 0xffff;
+		if (value && key < 256) report_keys[key >> 5] |= 1u << (key & 31);
+		report_keys_valid_ = true;
+		return;
+	}
+
 	// See if the value is in our keys_down list
 	usage &= 0xffff;		// only keep the actual key
 	if (usage == 0) return;	// lets not process 0, if only 0 happens, we will handle it on the end to remove existing pressed items.
@@ -501,6 +563,13 @@ void KeyboardController::hid_input_data(uint32_t usage, int32_t value)
 void KeyboardController::hid_input_end()
 {
 	//USBHDBGSerial.println("KPC:hid_input_end");
+	if (report_keys_valid_) {
+		update_keys(report_keys, report_keys_state);
+		memset(report_keys, 0, sizeof(report_keys));
+		report_keys_valid_ = false;
+		hid_input_begin_ = false;
+		return;
+	}
 	if (hid_input_begin_) {
 
 		// See if we received any data from parser if not, assume all keys released... 
@@ -566,20 +635,13 @@ bool KeyboardController::process_bluetooth_HID_data(const uint8_t *data, uint16_
 	if (data[0] != 1) return false;
 	print("  KB Data: ");
 	print_hexbytes(data, length);
-	for (int i=2; i < length; i++) {
-		uint32_t key = prev_report[i];
-		if (key >= 4 && !contains(key, report)) {
-			key_release(prev_report[0], key);
-		}
-	}
-	for (int i=2; i < 8; i++) {
-		uint32_t key = data[i];
-		if (key >= 4 && !contains(key, prev_report)) {
-			key_press(data[1], key);
-		}
-	}
-	// Save away the data.. But shift down one byte... Don't need the report number
-	memcpy(prev_report, &data[1], 8);
+	if (length < 9) return true;
+	// The boot format report follows the report number
+	uint32_t keys[8];
+	input_timestamp.frindex = 0;	// Bluetooth input is not stamped
+	input_timestamp.cycles = 0;
+	boot_report_to_keys(&data[1], keys);
+	update_keys(keys, boot_keys_state);
 	return true;
 }
 
@@ -610,6 +672,8 @@ uint16_t KeyboardController::idProduct()
 
 const uint8_t *KeyboardController::manufacturer()
 {
+	request_strings(device);
+	request_strings(mydevice);
 	if ((device != nullptr) && (device->strbuf != nullptr)) return &device->strbuf->buffer[device->strbuf->iStrings[strbuf_t::STR_ID_MAN]];
 	if ((btdevice != nullptr) && (btdevice->strbuf != nullptr)) return &btdevice->strbuf->buffer[btdevice->strbuf->iStrings[strbuf_t::STR_ID_MAN]]; 
 	if ((mydevice != nullptr) && (mydevice->strbuf != nullptr)) return &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_MAN]]; 
@@ -618,6 +682,8 @@ const uint8_t *KeyboardController::manufacturer()
 
 const uint8_t *KeyboardController::product()
 {
+	request_strings(device);
+	request_strings(mydevice);
 	if ((device != nullptr) && (device->strbuf != nullptr)) return &device->strbuf->buffer[device->strbuf->iStrings[strbuf_t::STR_ID_PROD]];
 	if ((mydevice != nullptr) && (mydevice->strbuf != nullptr)) return &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_PROD]]; 
 	if ((btdevice != nullptr) && (btdevice->strbuf != nullptr)) return &btdevice->strbuf->buffer[btdevice->strbuf->iStrings[strbuf_t::STR_ID_PROD]]; 
@@ -626,6 +692,8 @@ const uint8_t *KeyboardController::product()
 
 const uint8_t *KeyboardController::serialNumber()
 {
+	request_strings(device);
+	request_strings(mydevice);
 	if ((device != nullptr) && (device->strbuf != nullptr)) return &device->strbuf->buffer[device->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]];
 	if ((mydevice != nullptr) && (mydevice->strbuf != nullptr)) return &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]]; 
 	if ((btdevice != nullptr) && (btdevice->strbuf != nullptr)) return &btdevice->strbuf->buffer[btdevice->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]]; 
@@ -47,6 +47,10 @@
 // the number of items it will use, so we should not ever end up with
 // a situation where an item can't be allocated when it's needed.  Well,
 // unless there's a bug or oversight...
+//
+// Programs with many driver objects which rarely bind can instead define
+// USBHOST_NO_DRIVER_MEMORY and size all the pools at once with a single
+// USBHostMemory<> object, declared in USBHost_t36.h.
 
 
 // Lists of "free" memory
@@ -54,18 +58,25 @@ static Device_t * free_Device_list = NULL;
 static Pipe_t * free_Pipe_list = NULL;
 static Transfer_t * free_Transfer_list = NULL;
 static strbuf_t * free_strbuf_list = NULL;
-// A small amount of non-driver memory, just to get things started
-// TODO: is this really necessary?  Can these be eliminated, so we
-// use only memory from the drivers?
+#ifndef USBHOST_NO_DRIVER_MEMORY
+// A small amount of non-driver memory, just to get things started.
+// Only USBHub contributes Device_t, so without this a single device
+// plugged directly into the host port could not enumerate.  When
+// USBHOST_NO_DRIVER_MEMORY is used, USBHostMemory<> supplies these.
 static Device_t memory_Device[1];
-static Pipe_t memory_Pipe[1] __attribute__ ((aligned(32)));
-static Transfer_t memory_Transfer[4] __attribute__ ((aligned(32)));
+static Pipe_t memory_Pipe[1];
+static QH_t memory_QH[1] __attribute__ ((aligned(32)));
+static Transfer_t memory_Transfer[4];
+static qTD_t memory_qTD[4] __attribute__ ((aligned(32)));
+#endif
 
 void USBHost::init_Device_Pipe_Transfer_memory(void)
 {
+#ifndef USBHOST_NO_DRIVER_MEMORY
 	contribute_Devices(memory_Device, sizeof(memory_Device)/sizeof(Device_t));
-	contribute_Pipes(memory_Pipe, sizeof(memory_Pipe)/sizeof(Pipe_t));
-	contribute_Transfers(memory_Transfer, sizeof(memory_Transfer)/sizeof(Transfer_t));
+	contribute_Pipes(memory_Pipe, memory_QH, sizeof(memory_Pipe)/sizeof(Pipe_t));
+	contribute_Transfers(memory_Transfer, memory_qTD, sizeof(memory_Transfer)/sizeof(Transfer_t));
+#endif
 }
 
 Device_t * USBHost::allocate_Device(void)
@@ -81,29 +92,32 @@ void USBHost::free_Device(Device_t *device)
 	free_Device_list = device;
 }
 
+// Pipe_t and Transfer_t keep their qh and qtd pointers while on the
+// free lists, so these lists are linked by the next fields rather
+// than overwriting the first word.
 Pipe_t * USBHost::allocate_Pipe(void)
 {
 	Pipe_t *pipe = free_Pipe_list;
-	if (pipe) free_Pipe_list = *(Pipe_t **)pipe;
+	if (pipe) free_Pipe_list = pipe->next;
 	return pipe;
 }
 
 void USBHost::free_Pipe(Pipe_t *pipe)
 {
-	*(Pipe_t **)pipe = free_Pipe_list;
+	pipe->next = free_Pipe_list;
 	free_Pipe_list = pipe;
 }
 
 Transfer_t * USBHost::allocate_Transfer(void)
 {
 	Transfer_t *transfer = free_Transfer_list;
-	if (transfer) free_Transfer_list = *(Transfer_t **)transfer;
+	if (transfer) free_Transfer_list = transfer->next_followup;
 	return transfer;
 }
 
 void USBHost::free_Transfer(Transfer_t *transfer)
 {
-	*(Transfer_t **)transfer = free_Transfer_list;
+	transfer->next_followup = free_Transfer_list;
 	free_Transfer_list = transfer;
 }
 
@@ -134,20 +148,23 @@ void USBHost::contribute_Devices(Device_t *devices, uint32_t num)
 	}
 }
 
-void USBHost::contribute_Pipes(Pipe_t *pipes, uint32_t num)
+// Pipes and transfers are contributed as parallel arrays.  The software
+// structure in each slot is permanently paired with the hardware
+// structure in the same slot of the DMA array.
+void USBHost::contribute_Pipes(Pipe_t *pipes, QH_t *qhs, uint32_t num)
 {
-	Pipe_t *end = pipes + num;
-	for (Pipe_t *pipe = pipes; pipe < end; pipe++) {
-		free_Pipe(pipe);
+	for (uint32_t i=0; i < num; i++) {
+		pipes[i].qh = &qhs[i];
+		qhs[i].pipe = &pipes[i];
+		free_Pipe(&pipes[i]);
 	}
-
 }
 
-void USBHost::contribute_Transfers(Transfer_t *transfers, uint32_t num)
+void USBHost::contribute_Transfers(Transfer_t *transfers, qTD_t *qtds, uint32_t num)
 {
-	Transfer_t *end = transfers + num;
-	for (Transfer_t *transfer = transfers ; transfer < end; transfer++) {
-		free_Transfer(transfer);
+	for (uint32_t i=0; i < num; i++) {
+		transfers[i].qtd = &qtds[i];
+		free_Transfer(&transfers[i]);
 	}
 }
 
@@ -172,12 +189,12 @@ void USBHost::countFree(uint32_t &devices, uint32_t &pipes, uint32_t &transfers,
 	Pipe_t *pipe = free_Pipe_list;
 	while (pipe) {
 		npipe++;
-		pipe = *(Pipe_t **)pipe;
+		pipe = pipe->next;
 	}
 	Transfer_t *transfer = free_Transfer_list;
 	while (transfer) {
 		ntransfer++;
-		transfer = *(Transfer_t **)transfer;
+		transfer = transfer->next_followup;
 	}
 	strbuf_t *str = free_strbuf_list;
 	while (str) {
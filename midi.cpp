@@ -29,9 +29,11 @@
 
 void MIDIDeviceBase::init()
 {
-	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	contribute_Pipes(mypipes, myqhs, sizeof(mypipes)/sizeof(Pipe_t));
+	contribute_Transfers(mytransfers, myqtds, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+#endif
 	handleNoteOff = NULL;
 	handleNoteOn = NULL;
 	handleVelocityChange = NULL;
@@ -54,6 +56,8 @@ void MIDIDeviceBase::init()
 	handleRealTimeSystem = NULL;
 	rx_head = 0;
 	rx_tail = 0;
+	rx_stamp_head = 0;
+	rx_stamp_tail = 0;
 	rxpipe = NULL;
 	txpipe = NULL;
 	driver_ready_for_device(this);
@@ -210,11 +214,15 @@ bool MIDIDeviceBase::claim(Device_t *dev, int type, const uint8_t *descriptors,
 	}
 	rx_head = 0;
 	rx_tail = 0;
+	rx_stamp_head = 0;
+	rx_stamp_tail = 0;
 	msg_channel = 0;
 	msg_type = 0;
 	msg_data1 = 0;
 	msg_data2 = 0;
 	msg_sysex_len = 0;
+	msg_timestamp.frindex = 0;
+	msg_timestamp.cycles = 0;
 	// claim if either pipe created
 	return (rxpipe || txpipe);
 }
@@ -237,7 +245,7 @@ void MIDIDeviceBase::rx_data(const Transfer_t *transfer)
 {
 	println("MIDIDevice Receive");
 	print("  MIDI Data: ");
-	uint32_t len = (transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF)) >> 2;
+	uint32_t len = (transfer->length - ((transfer->qtd->token >> 16) & 0x7FFF)) >> 2;
 	print_hexbytes(transfer->buffer, len * 4);
 	uint32_t head = rx_head;
 	uint32_t tail = rx_tail;
@@ -248,6 +256,20 @@ void MIDIDeviceBase::rx_data(const Transfer_t *transfer)
 			rx_queue[head] = msg;
 		}
 	}
+	if (head != rx_head) {
+		// remember when this packet arrived.  If too many packets are
+		// waiting, its messages join the newest packet's and keep
+		// that earlier timestamp
+		uint32_t stamp = rx_stamp_head + 1;
+		if (stamp >= RX_STAMP_LEN) stamp = 0;
+		if (stamp != rx_stamp_tail) {
+			rx_stamp_end[stamp] = head;
+			rx_stamp[stamp] = transfer->timestamp;
+			rx_stamp_head = stamp;
+		} else {
+			rx_stamp_end[rx_stamp_head] = head;
+		}
+	}
 	rx_head = head;
 	rx_tail = tail;
 	uint32_t avail = (head < tail) ? tail - head - 1 : rx_queue_size - 1 - head + tail;
@@ -402,6 +424,12 @@ bool MIDIDeviceBase::read(uint8_t channel)
 	if (++tail >= rx_queue_size) tail = 0;
 	n = rx_queue[tail];
 	rx_tail = tail;
+	uint32_t stamp = rx_stamp_tail;
+	if (stamp != rx_stamp_head) {
+		if (++stamp >= RX_STAMP_LEN) stamp = 0;
+		msg_timestamp = rx_stamp[stamp];
+		if (rx_stamp_end[stamp] == tail) rx_stamp_tail = stamp;
+	}
 	if (!rx_packet_queued && rxpipe) {
 	        avail = (head < tail) ? tail - head - 1 : rx_queue_size - 1 - head + tail;
 		if (avail >= (uint32_t)(rx_size>>2)) {
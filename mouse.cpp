@@ -71,20 +71,25 @@ void MouseController::hid_input_data(uint32_t usage, int32_t value)
 		switch (usage) {
 		  case 0x30:
 			mouseX = value;
+			event.x = value;
 			break;
 		  case 0x31:
 			mouseY = value;
+			event.y = value;
 			break;
 		  case 0x32: // Apple uses this for horizontal scroll
 			wheelH = value;
+			event.wheelH = value;
 			break;
 		  case 0x38:
 			wheel = value;
+			event.wheel = value;
 			break;
 		}
 	} else if (usage_page == 12) {
 		if (usage == 0x238) { // Microsoft uses this for horizontal scroll
 			wheelH = value;
+			event.wheelH = value;
 		}
 	}
 }
@@ -94,6 +99,15 @@ void MouseController::hid_input_end()
 	if (hid_input_begin_) {
 		mouseEvent = true;
 		hid_input_begin_ = false;
+		event.buttons = buttons;
+		event.timestamp = input_timestamp;
+		events.write(event);
+		// begin is called for each field, so clear only once the
+		// whole report is done
+		event.x = 0;
+		event.y = 0;
+		event.wheel = 0;
+		event.wheelH = 0;
 	}
 }
 
@@ -156,6 +170,14 @@ bool MouseController::process_bluetooth_HID_data(const uint8_t *data, uint16_t l
 		}
 	}
 	mouseEvent = true;
+	event.x = mouseX;
+	event.y = mouseY;
+	event.wheel = (length >= 5) ? wheel : 0;
+	event.wheelH = (length >= 6) ? wheelH : 0;
+	event.buttons = buttons;
+	event.timestamp.frindex = 0;
+	event.timestamp.cycles = 0;
+	events.write(event);
 
 	return true;
 }
@@ -31,25 +31,32 @@
 
 #ifdef USBHOST_PRINT_DEBUG
 
-void USBHost::print_(const Transfer_t *transfer)
+static void print_qtd(const qTD_t *qtd)
 {
-	if (!((uint32_t)transfer & 0xFFFFFFE0)) return;
-	USBHDBGSerial.print("Transfer @ ");
-	USBHDBGSerial.println(((uint32_t)transfer & 0xFFFFFFE0), HEX);
+	USBHDBGSerial.print("   qTD @ ");
+	USBHDBGSerial.println((uint32_t)qtd, HEX);
 	USBHDBGSerial.print("   next:  ");
-	USBHDBGSerial.println(transfer->qtd.next, HEX);
+	USBHDBGSerial.println(qtd->next, HEX);
 	USBHDBGSerial.print("   anext: ");
-	USBHDBGSerial.println(transfer->qtd.alt_next, HEX);
+	USBHDBGSerial.println(qtd->alt_next, HEX);
 	USBHDBGSerial.print("   token: ");
-	USBHDBGSerial.println(transfer->qtd.token, HEX);
+	USBHDBGSerial.println(qtd->token, HEX);
 	USBHDBGSerial.print("   bufs:  ");
 	for (int i=0; i < 5; i++) {
-		USBHDBGSerial.print(transfer->qtd.buffer[i], HEX);
+		USBHDBGSerial.print(qtd->buffer[i], HEX);
 		if (i < 4) USBHDBGSerial.print(',');
 	}
 	USBHDBGSerial.println();
 }
 
+void USBHost::print_(const Transfer_t *transfer)
+{
+	if (!transfer) return;
+	USBHDBGSerial.print("Transfer @ ");
+	USBHDBGSerial.println((uint32_t)transfer, HEX);
+	print_qtd(transfer->qtd);
+}
+
 void USBHost::print_(const Transfer_t *first, const Transfer_t *last)
 {
 	USBHDBGSerial.print("Transfer Followup List ");
@@ -60,14 +67,14 @@ void USBHost::print_(const Transfer_t *first, const Transfer_t *last)
 	while (first) {
 		USBHDBGSerial.print("    ");
 		USBHDBGSerial.print((uint32_t)first, HEX);
-		print_token(first->qtd.token);
+		print_token(first->qtd->token);
 		first = first->next_followup;
 	}
 	USBHDBGSerial.println("    backward:");
 	while (last) {
 		USBHDBGSerial.print("    ");
 		USBHDBGSerial.print((uint32_t)last, HEX);
-		print_token(last->qtd.token);
+		print_token(last->qtd->token);
 		last = last->prev_followup;
 	}
 }
@@ -93,7 +100,8 @@ void USBHost::print_token(uint32_t token)
 
 void USBHost::print_(const Pipe_t *pipe)
 {
-	if (!((uint32_t)pipe & 0xFFFFFFE0)) return;
+	if (!pipe) return;
+	const QH_t *qh = pipe->qh;
 	USBHDBGSerial.print("Pipe ");
 	if (pipe->type == 0) USBHDBGSerial.print("control");
 	else if (pipe->type == 1) USBHDBGSerial.print("isochronous");
@@ -103,30 +111,32 @@ void USBHost::print_(const Pipe_t *pipe)
 	USBHDBGSerial.print("  @ ");
 	USBHDBGSerial.println((uint32_t)pipe, HEX);
 	USBHDBGSerial.print("  horiz link:  ");
-	USBHDBGSerial.println(pipe->qh.horizontal_link, HEX);
+	USBHDBGSerial.println(qh->horizontal_link, HEX);
 	USBHDBGSerial.print("  capabilities: ");
-	USBHDBGSerial.print(pipe->qh.capabilities[0], HEX);
+	USBHDBGSerial.print(qh->capabilities[0], HEX);
 	USBHDBGSerial.print(',');
-	USBHDBGSerial.println(pipe->qh.capabilities[1], HEX);
+	USBHDBGSerial.println(qh->capabilities[1], HEX);
 	USBHDBGSerial.println("  overlay:");
 	USBHDBGSerial.print("    cur:   ");
-	USBHDBGSerial.println(pipe->qh.current, HEX);
+	USBHDBGSerial.println(qh->current, HEX);
 	USBHDBGSerial.print("    next:  ");
-	USBHDBGSerial.println(pipe->qh.next, HEX);
+	USBHDBGSerial.println(qh->next, HEX);
 	USBHDBGSerial.print("    anext: ");
-	USBHDBGSerial.println(pipe->qh.alt_next, HEX);
+	USBHDBGSerial.println(qh->alt_next, HEX);
 	USBHDBGSerial.print("    token: ");
-	USBHDBGSerial.println(pipe->qh.token, HEX);
+	USBHDBGSerial.println(qh->token, HEX);
 	USBHDBGSerial.print("    bufs:  ");
 	for (int i=0; i < 5; i++) {
-		USBHDBGSerial.print(pipe->qh.buffer[i], HEX);
+		USBHDBGSerial.print(qh->buffer[i], HEX);
 		if (i < 4) USBHDBGSerial.print(',');
 	}
 	USBHDBGSerial.println();
-	const Transfer_t *t = (Transfer_t *)pipe->qh.next;
-	while (((uint32_t)t & 0xFFFFFFE0)) {
-		print_(t);
-		t = (Transfer_t *)t->qtd.next;
+	USBHDBGSerial.print("  QH @ ");
+	USBHDBGSerial.println((uint32_t)qh, HEX);
+	const qTD_t *qtd = (const qTD_t *)qh->next;
+	while (((uint32_t)qtd & 0xFFFFFFE0)) {
+		print_qtd(qtd);
+		qtd = (const qTD_t *)qtd->next;
 	}
 	//USBHDBGSerial.print();
 }
@@ -161,8 +171,9 @@ void USBHost::print_qh_list(const Pipe_t *list)
 	const Pipe_t *node = list;
 	while (1) {
 		USBHDBGSerial.print((uint32_t)node, HEX);
-		node = (const Pipe_t *)(node->qh.horizontal_link & 0xFFFFFFE0);
-		if (!node) break;
+		const QH_t *qh = (const QH_t *)(node->qh->horizontal_link & 0xFFFFFFE0);
+		if (!qh) break;
+		node = qh->pipe;
 		if (node == list) {
 			USBHDBGSerial.print(" (loops)");
 			break;
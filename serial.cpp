@@ -64,11 +64,24 @@ USBSerialBase::product_vendor_mapping_t USBSerialBase::pid_vid_mapping[] = {
 //  Initialization and claiming of devices & interfaces
 /************************************************************/
 
+// CDC ACM devices, CDC ACM functions grouped by an IAD, and CDC data
+// interfaces.  Other serial adapters are matched from pid_vid_mapping.
+static const driver_match_t serial_match[] = {
+	{driver_match_t::DEVICE, driver_match_t::CLASS | driver_match_t::SUBCLASS, 0, 0, 2, 0, 0},
+	{driver_match_t::IAD, driver_match_t::CLASS | driver_match_t::SUBCLASS, 0, 0, 2, 2, 0},
+	{driver_match_t::INTERFACE, driver_match_t::CLASS | driver_match_t::SUBCLASS
+		| driver_match_t::PROTOCOL, 0, 0, 0x0A, 0, 0}
+};
+
 void USBSerialBase::init()
 {
-	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+#ifndef USBHOST_NO_DRIVER_MEMORY
+	contribute_Pipes(mypipes, myqhs, sizeof(mypipes)/sizeof(Pipe_t));
+	contribute_Transfers(mytransfers, myqtds, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+#endif
+	match_table(serial_match, sizeof(serial_match)/sizeof(driver_match_t));
+	match_ids(pid_vid_mapping, driver_match_t::DEVICE | driver_match_t::INTERFACE);
 	driver_ready_for_device(this);
 	format_ = USBHOST_SERIAL_8N1;
 }
@@ -85,9 +98,11 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 	print_hexbytes(descriptors, len);
 
 	//---------------------------------------------------------------------------
-	// Lets try to map CDCACM devices only at device level
-	if ((dev->bDeviceClass == 2) && (dev->bDeviceSubClass == 0)) {
-		if (type != 0) return false;
+	// Lets try to map CDCACM devices at device level, or a CDCACM function
+	// of a composite device, grouped by an Interface Association Descriptor
+	bool cdcacm_iad = (type == 2 && descriptors[4] == 2 && descriptors[5] == 2);
+	if (((dev->bDeviceClass == 2) && (dev->bDeviceSubClass == 0)) || cdcacm_iad) {
+		if (type == 1) return false;
 
 		// It is a communication device see if we can extract the data... 
 		// Try some ttyACM types? 
@@ -105,18 +120,19 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 		const uint8_t *p = descriptors;
 		const uint8_t *end = p + len;
 
+		if (cdcacm_iad) p += 8; // skip the IAD
 		if (p[0] != 9 || p[1] != 4) return false; // interface descriptor
 		//println("  bInterfaceClass=", p[5]);
 		//println("  bInterfaceSubClass=", p[6]);
 		if (p[5] != 2) return false; // bInterfaceClass: 2 Communications
 		if (p[6] != 2) return false; // bInterfaceSubClass: 2 serial 
+		interface = p[2];	// class requests go to the communications interface
 		p += 9;
 		println("  Interface is Serial");
 		uint8_t rx_ep = 0;
 		uint8_t tx_ep = 0;
 		uint16_t rx_size = 0;
 		uint16_t tx_size = 0;
-		interface = 0;	// clear out any interface numbers passed in. 
 
 		while (p < end) {
 			len = *p;
@@ -125,9 +141,8 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 			uint32_t type = p[1];
 			//println("type: ", type);
 			// Unlike Audio, we need to look at Interface as our endpoints are after them...
-			if (type == 4 ) { // Interface - lets remember it's number...
-				interface = p[2];
-				println("    Interface: ", interface);
+			if (type == 4 ) { // Interface, probably the data interface
+				println("    Interface: ", p[2]);
 			}
 			else if (type == 0x24) {  // 0x24 = CS_INTERFACE, 
 				uint32_t subtype = p[2];
@@ -206,7 +221,7 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 #if 0
 		println("Control - CDCACM DTR...");
 		// Need to setup  the data the line coding data
-		mk_setup(setup, 0x21, 0x22, 3, 0, 0);
+		mk_setup(setup, 0x21, 0x22, 3, interface, 0);
 		queue_Control_Transfer(dev, &setup, NULL, this);
 		control_queued = true;
 		pending_control = 0x0;	// Maybe don't need to do...
@@ -222,6 +237,8 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 	//---------------------------------------------------------------------------
 	// Else lets see if this is a PID/VID we know something about.
 	// See if the vendor_id:product_id is in our list of products.
+	if (type == 2) return false;
+	interface = 0;
 	sertype = UNKNOWN;
 	for (uint8_t i = 0; i < (sizeof(pid_vid_mapping)/sizeof(pid_vid_mapping[0])); i++) {
 		if ((dev->idVendor == pid_vid_mapping[i].idVendor) && (dev->idProduct == pid_vid_mapping[i].idProduct)) {
@@ -383,7 +400,7 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 		    setupdata[4] = 0; // 0 - 1 stop bit, 1 - 1.5 stop bits, 2 - 2 stop bits
 		    setupdata[5] = 0; // 0 - None, 1 - Odd, 2 - Even, 3 - Mark, 4 - Space
 		    setupdata[6] = 8; // Data bits (5, 6, 7, 8 or 16)
-			mk_setup(setup, 0x21, 0x20, 0, 0, 7);
+			mk_setup(setup, 0x21, 0x20, 0, interface, 7);
 			queue_Control_Transfer(dev, &setup, setupdata, this);
 			pending_control = 0x04;	// Maybe don't need to do...
 			control_queued = true;
@@ -523,7 +540,7 @@ void USBSerialBase::control(const Transfer_t *transfer)
 	        setupdata[6] = format_ & 0x1f;				// Data bits (5, 6, 7, 8 or 16)
 	        print("CDCACM setup: ");
 	        print_hexbytes(&setupdata, 7);
-			mk_setup(setup, 0x21, 0x20, 0, 0, 7);
+			mk_setup(setup, 0x21, 0x20, 0, interface, 7);
 			queue_Control_Transfer(device, &setup, setupdata, this);
 			control_queued = true;
 			return;
@@ -533,7 +550,7 @@ void USBSerialBase::control(const Transfer_t *transfer)
 			pending_control &= ~4;
 			println("Control - 0x21,0x22, 0x3");
 			// Need to setup  the data the line coding data
-			mk_setup(setup, 0x21, 0x22, 3, 0, 0);
+			mk_setup(setup, 0x21, 0x22, 3, interface, 0);
 			queue_Control_Transfer(device, &setup, NULL, this);
 			dtr_rts_ = 3;
 			control_queued = true;
@@ -543,7 +560,7 @@ void USBSerialBase::control(const Transfer_t *transfer)
 			pending_control &= ~0x80;
 			println("Control - 0x21,0x22, 0x0 - clear DTR");
 			// Need to setup  the data the line coding data
-			mk_setup(setup, 0x21, 0x22, 0, 0, 0);
+			mk_setup(setup, 0x21, 0x22, 0, interface, 0);
 			queue_Control_Transfer(device, &setup, NULL, this);
 			dtr_rts_ = 0;
 			control_queued = true;
@@ -675,7 +692,7 @@ void USBSerialBase::control(const Transfer_t *transfer)
 	        print("PL2303: Set baud/control: ", baudrate, HEX);
 	        print(" = ");
 	        print_hexbytes(&setupdata, 7);
-			mk_setup(setup, 0x21, 0x20, 0, 0, 7);
+			mk_setup(setup, 0x21, 0x20, 0, interface, 7);
 			queue_Control_Transfer(device, &setup, setupdata, this);
 			control_queued = true;
 			return;
@@ -703,7 +720,7 @@ void USBSerialBase::control(const Transfer_t *transfer)
 
 			// This sets the control lines (0x1=DTR, 0x2=RTS)
 			println("PL2303: 0x21, 0x22, 0x3");
-			mk_setup(setup, 0x21, 0x22, 3, 0, 0); // 
+			mk_setup(setup, 0x21, 0x22, 3, interface, 0); // 
 			queue_Control_Transfer(device, &setup, NULL, this);
 			dtr_rts_ = 3;
 			control_queued = true;
@@ -712,14 +729,14 @@ void USBSerialBase::control(const Transfer_t *transfer)
 		if (pending_control & 0x20) {
 			pending_control &= ~0x20;
 			println("PL2303: 0x21, 0x22, 0x3");
-			mk_setup(setup, 0x21, 0x22, 3, 0, 0); // 
+			mk_setup(setup, 0x21, 0x22, 3, interface, 0); // 
 			queue_Control_Transfer(device, &setup, NULL, this);
 			control_queued = true;
 		}
 		if (pending_control & 0x80) {
 			pending_control &= ~0x80;
 			println("PL2303: 0x21, 0x22, 0x0");  // Clear DTR/RTS
-			mk_setup(setup, 0x21, 0x22, 0, 0, 0); // 
+			mk_setup(setup, 0x21, 0x22, 0, interface, 0); // 
 			queue_Control_Transfer(device, &setup, NULL, this);
 			dtr_rts_ = 0;
 			control_queued = true;
@@ -983,7 +1000,7 @@ void USBSerialBase::tx_callback(const Transfer_t *transfer)
 
 void USBSerialBase::rx_data(const Transfer_t *transfer)
 {
-	uint32_t len = transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF);
+	uint32_t len = transfer->length - ((transfer->qtd->token >> 16) & 0x7FFF);
 
 	debugDigitalToggle(6);
 	// first update rxstate bitmask, since buffer is no longer queued
@@ -1003,7 +1020,7 @@ void USBSerialBase::rx_data(const Transfer_t *transfer)
 		}
 	}
 	if (len > 0) {
-		print("rx token: ", transfer->qtd.token, HEX);
+		print("rx token: ", transfer->qtd->token, HEX);
 		print(" transfer length: ", transfer->length, DEC);
 		print(" len:", len, DEC);
 		print(" - ", *p, HEX);
@@ -1374,7 +1391,7 @@ bool USBSerialBase::setDTR(bool fSet)
 			return false; // Not sure how to do...
 		case PL2303:
 		case CDCACM: 
-			mk_setup(setup, 0x21, 0x22, dtr_rts_, 0, 0);
+			mk_setup(setup, 0x21, 0x22, dtr_rts_, interface, 0);
 			break;
 		case FTDI: 
 			println("  >>FTDI");
@@ -1417,7 +1434,7 @@ bool USBSerialBase::setRTS(bool fSet)
 			return false; // Not sure how to do...
 		case PL2303:
 		case CDCACM: 
-			mk_setup(setup, 0x21, 0x22, dtr_rts_, 0, 0);
+			mk_setup(setup, 0x21, 0x22, dtr_rts_, interface, 0);
 			break;
 		case FTDI: 
 			println("  >>FTDI");